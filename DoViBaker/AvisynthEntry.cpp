@@ -4,6 +4,7 @@
 #pragma warning(pop)
 
 #include "DoViBaker.h"
+#include <chrono>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -19,6 +20,15 @@ AVSValue __cdecl Create_RealDoViBaker(
   bool rgbProof,
   bool nlqProof,
   bool outYUV,
+  int prefetch,
+  bool nativeRpu,
+  int outputDepth,
+  bool outYUV420,
+  int downscale,
+  int quality,
+  std::string filter,
+  bool approxMmr,
+  bool mmrTable,
   const AVSValue* args, 
   IScriptEnvironment* env)
 {
@@ -30,6 +40,18 @@ AVSValue __cdecl Create_RealDoViBaker(
     env->ThrowError("DoViBaker: Clip must be in YUV format");
   }
 
+  // qnd is the lowest quality tier
+  if (quality < 0) {
+    quality = qnd ? 0 : 2;
+  }
+  if (quality > 2) {
+    env->ThrowError("DoViBaker: quality must be 0, 1 or 2");
+  }
+  if (qnd && quality != 0) {
+    env->ThrowError("DoViBaker: qnd=true cannot be combined with quality 1 or 2");
+  }
+  qnd = quality < 2;
+
   int blClipChromaSubSampled = -1;
   if (blclip->GetVideoInfo().Is420()) {
     blClipChromaSubSampled = 1;
@@ -56,9 +78,6 @@ AVSValue __cdecl Create_RealDoViBaker(
   }
 
   if (outYUV) {
-      if (blClipChromaSubSampled != elClipChromaSubSampled) {
-          env->ThrowError("DoViBaker: Both BL and EL must have same chroma subsampling when outYUV=true");
-      }
       if (!cubeFiles.empty()) {
           env->ThrowError("DoViBaker: cubes cannot be used when outYUV=true");
       }
@@ -69,26 +88,84 @@ AVSValue __cdecl Create_RealDoViBaker(
           env->ThrowError("DoViBaker: cubes_basepath cannot be used when outYUV=true");
       }
       if (qnd) {
-          env->ThrowError("DoViBaker: qnd cannot be true when outYUV=true");
+          env->ThrowError("DoViBaker: qnd or quality below 2 cannot be used when outYUV=true");
       }
       if (rgbProof) {
           env->ThrowError("DoViBaker: rgbProof cannot be true when outYUV=true");
       }
   }
 
+  if (outYUV420) {
+    if (outYUV) {
+      env->ThrowError("DoViBaker: outYUV and outYUV420 cannot both be true");
+    }
+    if (qnd) {
+      env->ThrowError("DoViBaker: qnd or quality below 2 cannot be used when outYUV420=true");
+    }
+    if ((blclip->GetVideoInfo().width & 1) || (blclip->GetVideoInfo().height & 1)) {
+      env->ThrowError("DoViBaker: outYUV420 requires an even width and height");
+    }
+  }
+
+  if (downscale != 1 && downscale != 2) {
+    env->ThrowError("DoViBaker: downscale must be 1 or 2");
+  }
+  if (downscale == 2 && ((blclip->GetVideoInfo().width & 3) || (blclip->GetVideoInfo().height & 3))) {
+    env->ThrowError("DoViBaker: downscale=2 requires width and height of the Base Layer to be divisible by 4");
+  }
+
+  UpsampleFilter upsampleFilter = UpsampleFilter::SPLINE16;
+  if (filter == "bilinear") {
+    upsampleFilter = UpsampleFilter::BILINEAR;
+  }
+  else if (filter == "spline16exact") {
+    upsampleFilter = UpsampleFilter::SPLINE16_EXACT;
+  }
+  else if (filter == "spline36") {
+    upsampleFilter = UpsampleFilter::SPLINE36;
+  }
+  else if (filter != "spline16") {
+    env->ThrowError("DoViBaker: filter must be bilinear, spline16, spline16exact or spline36");
+  }
+
+  if (prefetch < 0) {
+    env->ThrowError("DoViBaker: prefetch must not be negative");
+  }
+
+  if (outputDepth != 10 && outputDepth != 12 && outputDepth != 16 && outputDepth != 32) {
+    env->ThrowError("DoViBaker: output_depth must be 10, 12, 16 or 32");
+  }
+  if (outputDepth == 32) {
+    if (outYUV || outYUV420) {
+      env->ThrowError("DoViBaker: output_depth=32 is only available for RGB output");
+    }
+    if (qnd) {
+      env->ThrowError("DoViBaker: qnd or quality below 2 cannot be used when output_depth=32");
+    }
+  }
+
+  // when downscaling, the BL is brought to the size of a quarter resolution EL first
+  const int blWidth = blclip->GetVideoInfo().width / downscale;
+  const int blHeight = blclip->GetVideoInfo().height / downscale;
   int quarterResolutionEl = 0;
   if (elclip) {
     quarterResolutionEl = -1;
-    if ((blclip->GetVideoInfo().width == elclip->GetVideoInfo().width) && (blclip->GetVideoInfo().height == elclip->GetVideoInfo().height)) {
+    if ((blWidth == elclip->GetVideoInfo().width) && (blHeight == elclip->GetVideoInfo().height)) {
       quarterResolutionEl = 0;
     }
-    if ((blclip->GetVideoInfo().width == 2 * elclip->GetVideoInfo().width) && (blclip->GetVideoInfo().height == 2 * elclip->GetVideoInfo().height)) {
+    if ((blWidth == 2 * elclip->GetVideoInfo().width) && (blHeight == 2 * elclip->GetVideoInfo().height)) {
       quarterResolutionEl = 1;
     }
     if (quarterResolutionEl < 0) {
+      if (downscale == 2)
+        env->ThrowError("DoViBaker: downscale=2 requires the Enhancement Layer to be quarter size of the Base Layer");
       env->ThrowError("DoViBaker: Enhancement Layer must either be same size or quarter size as Base Layer");
     }
   }
+  // a quarter size EL is upsampled while composing, then only the subsampling of the BL matters
+  if (outYUV && blClipChromaSubSampled != elClipChromaSubSampled && !(blClipChromaSubSampled && quarterResolutionEl)) {
+    env->ThrowError("DoViBaker: Both BL and EL must have same chroma subsampling when outYUV=true, unless the BL is 420 and the EL is quarter size");
+  }
   std::stringstream ssCubeFiles(cubeFiles);
   std::vector<std::string> cubesList;
   std::string segment;
@@ -115,10 +192,10 @@ AVSValue __cdecl Create_RealDoViBaker(
   }
   
   if (quarterResolutionEl == 0) {
-    return new DoViBaker<false>(blclip, elclip, rpuPath, blClipChromaSubSampled, elClipChromaSubSampled, cubeNitsPairs, qnd, rgbProof, nlqProof, outYUV, env);
+    return new DoViBaker<false>(blclip, elclip, rpuPath, blClipChromaSubSampled, elClipChromaSubSampled, cubeNitsPairs, quality, rgbProof, nlqProof, outYUV, prefetch, nativeRpu, outputDepth, outYUV420, downscale == 2, upsampleFilter, approxMmr, mmrTable, env);
   }
   if (quarterResolutionEl == 1) {
-    return new DoViBaker<true>(blclip, elclip, rpuPath, blClipChromaSubSampled, elClipChromaSubSampled, cubeNitsPairs, qnd, rgbProof, nlqProof, outYUV, env);
+    return new DoViBaker<true>(blclip, elclip, rpuPath, blClipChromaSubSampled, elClipChromaSubSampled, cubeNitsPairs, quality, rgbProof, nlqProof, outYUV, prefetch, nativeRpu, outputDepth, outYUV420, downscale == 2, upsampleFilter, approxMmr, mmrTable, env);
   }
 }
 
@@ -136,6 +213,15 @@ AVSValue __cdecl Create_DoViBaker(AVSValue args, void* user_data, IScriptEnviron
     args[7].AsBool(false),
     args[8].AsBool(false),
     args[9].AsBool(false),
+    args[10].AsInt(0),
+    args[11].AsBool(false),
+    args[12].AsInt(16),
+    args[13].AsBool(false),
+    args[14].AsInt(1),
+    args[15].AsInt(-1),
+    args[16].AsString("spline16"),
+    args[17].AsBool(false),
+    args[18].AsBool(false),
     &args, env);
 }
 
@@ -145,143 +231,202 @@ extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit3(IScri
 {
   AVS_linkage = vectors;
 
-  env->AddFunction("DoViBaker", "c[el]c[rpu]s[cubes]s[mclls]s[cubes_basepath]s[qnd]b[rgbProof]b[nlqProof]b[outYUV]b", Create_DoViBaker, 0);
+  env->AddFunction("DoViBaker", "c[el]c[rpu]s[cubes]s[mclls]s[cubes_basepath]s[qnd]b[rgbProof]b[nlqProof]b[outYUV]b[prefetch]i[nativeRpu]b[output_depth]i[outYUV420]b[downscale]i[quality]i[filter]s[approxMmr]b[mmrTable]b", Create_DoViBaker, 0);
 
   return "Hey it is just a spectrogram!";
 }
 
-void ypp2ycc(uint16_t* ycc, float y, float u, float v) {
-  static const uint16_t scale = 1 << DoViProcessor::containerBitDepth;
-  static const uint16_t bias = 16 << (DoViProcessor::containerBitDepth - 8);
-  static const uint16_t ltop = scale - (21 << (DoViProcessor::containerBitDepth - 8));
-  static const uint16_t ctop = scale - (16 << (DoViProcessor::containerBitDepth - 8));
-
-  ycc[0] = y * (ltop - bias) + bias;
-  ycc[1] = (u + 0.5) * (ctop - bias) + bias;
-  ycc[2] = (v + 0.5) * (ctop - bias) + bias;
-}
-
 inline uint16_t to8bits(uint16_t sample) {
   // we just check for 8bit precicion deviations, assuming smaller differences to be not visible
   return (sample >> (DoViProcessor::containerBitDepth - 8));
 }
 
-bool checkElProcessing(const DoViProcessor &dovi) {
-  uint16_t yuv[3];
-  ypp2ycc(yuv, 0.5000, 0.0000, 0.0000);
-  uint16_t inGrey = yuv[0];
-  ypp2ycc(yuv, 1.0000, 0.0000, 0.0000);
-  uint16_t elHi = yuv[0];
-  ypp2ycc(yuv, 0.0000, 0.0000, 0.0000);
-  uint16_t elLo = yuv[0];
-  uint16_t outHi = dovi.processSampleY(inGrey, elHi);
-  uint16_t outLo = dovi.processSampleY(inGrey, elLo);
-  return outHi != outLo;
-}
+int compareDecoders(const char* rpuPath)
+{
+  DoViProcessor libdovi(rpuPath, NULL);
+  DoViProcessor native(rpuPath, NULL, true);
+  if (!libdovi.wasCreationSuccessful() || !native.wasCreationSuccessful()) {
+    return 1;
+  }
 
-uint16_t checkMatrix(const DoViProcessor& dovi) {
-  uint16_t yuv[3];
-  uint16_t rgb[3];
-  uint16_t diffBits = 0;
-
-  static const uint16_t maxNormRGB = 255 << (DoViProcessor::containerBitDepth - 8);
-  static const uint16_t halfNormRGB = maxNormRGB >> 1;
-
-  ypp2ycc(yuv, 1.0000, 0.0000, 0.0000);
-  dovi.sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
-  diffBits |= std::abs(rgb[0] - maxNormRGB);
-  diffBits |= std::abs(rgb[1] - maxNormRGB);
-  diffBits |= std::abs(rgb[2] - maxNormRGB);
-    
-  ypp2ycc(yuv, 0.0000, 0.0000, 0.0000);
-  dovi.sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
-  diffBits |= rgb[0];
-  diffBits |= rgb[1];
-  diffBits |= rgb[2];
-
-  ypp2ycc(yuv, 0.5000, 0.0000, 0.0000);
-  dovi.sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
-  diffBits |= std::abs(rgb[0] - halfNormRGB);
-  diffBits |= std::abs(rgb[1] - halfNormRGB);
-  diffBits |= std::abs(rgb[2] - halfNormRGB);
-
-  ypp2ycc(yuv, 0.2627 / 2, -0.1396 / 2, 0.5000 / 2);
-  dovi.sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
-  diffBits |= std::abs(rgb[0] - halfNormRGB);
-  diffBits |= rgb[1];
-  diffBits |= rgb[2];
-
-  ypp2ycc(yuv, 0.6780 / 2, -0.3604 / 2, -0.4598 / 2);
-  dovi.sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
-  diffBits |= rgb[0];
-  diffBits |= std::abs(rgb[1] - halfNormRGB);
-  diffBits |= rgb[2];
-  
-  ypp2ycc(yuv, 0.0593 / 2, 0.5000 / 2, -0.0402 / 2);
-  dovi.sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
-  diffBits |= rgb[0];
-  diffBits |= rgb[1];
-  diffBits |= std::abs(rgb[2] - halfNormRGB);
+  int length = libdovi.getClipLength();
+  if (native.getClipLength() != length) {
+    printf("clip length differs: libdovi %i, native %i\n", length, native.getClipLength());
+    return 1;
+  }
+  DoViFrameParams libdoviParams, nativeParams;
+  DoViFrameInfo libdoviInfo, nativeInfo;
+  std::chrono::steady_clock::duration libdoviTime(0), nativeTime(0);
+  int mismatches = 0;
+  for (int i = 0; i < length; i++) {
+    auto t0 = std::chrono::steady_clock::now();
+    bool libdoviOk = libdovi.decodeFrame(i, libdoviParams, libdoviInfo, NULL);
+    auto t1 = std::chrono::steady_clock::now();
+    bool nativeOk = native.decodeFrame(i, nativeParams, nativeInfo, NULL);
+    auto t2 = std::chrono::steady_clock::now();
+    libdoviTime += t1 - t0;
+    nativeTime += t2 - t1;
+    if (libdoviOk != nativeOk || !(libdoviParams == nativeParams) || memcmp(&libdoviInfo, &nativeInfo, sizeof(DoViFrameInfo)) != 0) {
+      if (mismatches < 10) {
+        printf("frame %i: decoded parameters differ\n", i);
+      }
+      mismatches++;
+    }
+  }
 
-  return diffBits;
+  printf("clip length: %i\n", length);
+  printf("frames with differences: %i\n", mismatches);
+  printf("libdovi: %.2f us per frame\n", std::chrono::duration<double, std::micro>(libdoviTime).count() / length);
+  printf("native: %.2f us per frame\n", std::chrono::duration<double, std::micro>(nativeTime).count() / length);
+  return mismatches ? 1 : 0;
 }
 
-uint16_t checkNonIdentityMapping(const DoViProcessor& dovi) {
-  uint16_t yuv[3];
-  uint16_t ely = dovi.getNlqOffset(0);
-  uint16_t diffBits = 0;
-  for (int i = 0; i <= 10; i++) {
-    ypp2ycc(yuv, float(i) / 10.0, 0.0000, 0.0000);
-    uint16_t bly = yuv[0];
-    int y = dovi.processSampleY(bly, ely);
-    diffBits |= std::abs(y - bly);
-  }
-  return diffBits;
-}
+// a deterministic 10bit 420 clip with gradients and noise, such that the upsampling of the tiers makes a difference.
+// a small pool of frames is built upfront and repeated over the whole length, so a benchmark only measures the filters consuming them
+class SyntheticClip : public IClip
+{
+public:
+  SyntheticClip(int width, int height, int numFrames, int poolSize, int base, int range, int noise, IScriptEnvironment* env)
+  {
+    memset(&vi, 0, sizeof(VideoInfo));
+    vi.width = width;
+    vi.height = height;
+    vi.num_frames = numFrames;
+    vi.fps_numerator = 24000;
+    vi.fps_denominator = 1001;
+    vi.pixel_type = VideoInfo::CS_YUV420P10;
+    for (int n = 0; n < min(poolSize, numFrames); n++) {
+      frames.push_back(makeFrame(n, base, range, noise, env));
+    }
+  }
 
-double Spline16Filter(double value) {
-  value = fabs(value);
+  PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env) override { return frames[min(max(n, 0), vi.num_frames - 1) % frames.size()]; }
+  bool __stdcall GetParity(int n) override { return false; }
+  void __stdcall GetAudio(void* buf, int64_t start, int64_t count, IScriptEnvironment* env) override {}
+  int __stdcall SetCacheHints(int cachehints, int frame_range) override { return 0; }
+  const VideoInfo& __stdcall GetVideoInfo() override { return vi; }
 
-  if (value < 1.0) {
-    return ((value - 9.0 / 5.0) * value - 1.0 / 5.0) * value + 1.0;
-  }
-  else if (value < 2.0) {
-    return ((-1.0 / 3.0 * (value - 1.0) + 4.0 / 5.0) * (value - 1.0) - 7.0 / 15.0) * (value - 1.0);
+private:
+  PVideoFrame makeFrame(int n, int base, int range, int noise, IScriptEnvironment* env) const
+  {
+    static const int planes[] = { PLANAR_Y, PLANAR_U, PLANAR_V };
+    PVideoFrame frame = env->NewVideoFrame(vi);
+    for (int p = 0; p < 3; p++) {
+      const int pitch = frame->GetPitch(planes[p]) / sizeof(uint16_t);
+      const int width = frame->GetRowSize(planes[p]) / sizeof(uint16_t);
+      const int height = frame->GetHeight(planes[p]);
+      uint16_t* dstp = (uint16_t*)frame->GetWritePtr(planes[p]);
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          uint32_t h = (x * 73856093u) ^ (y * 19349663u) ^ ((n * 3 + p) * 83492791u);
+          h ^= h >> 13;
+          h *= 0x5bd1e995u;
+          h ^= h >> 15;
+          const int v = base + ((x * (p + 3) + y * 2 + n * 7) % range) + int(h % (2 * noise + 1)) - noise;
+          dstp[x] = uint16_t(max(0, min(1023, v)));
+        }
+        dstp += pitch;
+      }
+    }
+    return frame;
   }
-  return 0.0;
-}
 
-double Spline36Filter(double value) {
-  value = fabs(value);
+  VideoInfo vi;
+  std::vector<PVideoFrame> frames;
+};
 
-  if (value < 1.0) {
-    return ((13.0 / 11.0 * (value)-453.0 / 209.0) * (value)-3.0 / 209.0) * (value)+1.0;
-  }
-  else if (value < 2.0) {
-    return ((-6.0 / 11.0 * (value - 1.0) + 270.0 / 209.0) * (value - 1.0) - 156.0 / 209.0) * (value - 1.0);
+int benchmarkQuality(const char* rpuPath, int numFrames)
+{
+  // the clips must span the whole RPU file, only its first frames are composed
+  int clipLength;
+  {
+    DoViProcessor dovi(rpuPath, NULL);
+    if (!dovi.wasCreationSuccessful()) {
+      return 1;
+    }
+    clipLength = dovi.getClipLength();
   }
-  else if (value < 3.0) {
-    return  ((1.0 / 11.0 * (value - 2.0) - 45.0 / 209.0) * (value - 2.0) + 26.0 / 209.0) * (value - 2.0);
+  const int length = min(numFrames, clipLength);
+  if (length <= 0) {
+    printf("DoViAnalyzer: no frames to benchmark\n");
+    return 1;
   }
-  return 0.0;
-}
-
-double Spline64Filter(double value) {
-  value = fabs(value);
 
-  if (value < 1.0) {
-    return ((49.0 / 41.0 * (value)-6387.0 / 2911.0) * (value)-3.0 / 2911.0) * (value)+1.0;
+  HINSTANCE avsLib = ::LoadLibrary(L"AviSynth.dll");
+  if (avsLib == NULL) {
+    printf("DoViAnalyzer: Cannot load AviSynth.dll\n");
+    return 1;
+  }
+  auto createEnv = (decltype(&CreateScriptEnvironment))GetProcAddress(avsLib, "CreateScriptEnvironment");
+  IScriptEnvironment* env = createEnv ? createEnv(AVISYNTH_INTERFACE_VERSION) : NULL;
+  if (env == NULL) {
+    printf("DoViAnalyzer: Cannot create a script environment\n");
+    ::FreeLibrary(avsLib);
+    return 1;
   }
-  else if (value < 2.0) {
-    return ((-24.0 / 41.0 * (value - 1.0) + 4032.0 / 2911.0) * (value - 1.0) - 2328.0 / 2911.0) * (value - 1.0);
+  AVS_linkage = env->GetAVSLinkage();
+
+  static const int tiers = 3;
+  std::chrono::steady_clock::duration time[tiers] = {};
+  int maxError[tiers] = {};
+  int result = 0;
+  try {
+    // a full hd BL with a quarter size EL, the residual of the EL stays small around its neutral value
+    static const int poolSize = 8;
+    PClip bl = new SyntheticClip(1920, 1080, clipLength, poolSize, 64, 876, 24, env);
+    PClip el = new SyntheticClip(960, 540, clipLength, poolSize, 496, 32, 8, env);
+
+    PClip clips[tiers];
+    for (int q = 0; q < tiers; q++) {
+      clips[q] = Create_RealDoViBaker(bl, el, rpuPath, "", "", "", false, false, false, false, 0, false, 16, false, 1, q, "spline16", false, false, NULL, env).AsClip();
+    }
+
+    static const int planes[] = { PLANAR_R, PLANAR_G, PLANAR_B };
+    for (int i = 0; i < length; i++) {
+      PVideoFrame frames[tiers];
+      // quality=2 first, it is the reference of the others
+      for (int q = tiers - 1; q >= 0; q--) {
+        auto t0 = std::chrono::steady_clock::now();
+        frames[q] = clips[q]->GetFrame(i, env);
+        time[q] += std::chrono::steady_clock::now() - t0;
+      }
+      for (int q = 0; q < tiers - 1; q++) {
+        for (int p = 0; p < 3; p++) {
+          const int refPitch = frames[tiers - 1]->GetPitch(planes[p]) / sizeof(uint16_t);
+          const int pitch = frames[q]->GetPitch(planes[p]) / sizeof(uint16_t);
+          const int width = frames[q]->GetRowSize(planes[p]) / sizeof(uint16_t);
+          const uint16_t* refp = (const uint16_t*)frames[tiers - 1]->GetReadPtr(planes[p]);
+          const uint16_t* srcp = (const uint16_t*)frames[q]->GetReadPtr(planes[p]);
+          for (int y = 0; y < frames[q]->GetHeight(planes[p]); y++) {
+            for (int x = 0; x < width; x++) {
+              maxError[q] = max(maxError[q], std::abs(srcp[x] - refp[x]));
+            }
+            refp += refPitch;
+            srcp += pitch;
+          }
+        }
+      }
+    }
   }
-  else if (value < 3.0) {
-    return ((6.0 / 41.0 * (value - 2.0) - 1008.0 / 2911.0) * (value - 2.0) + 582.0 / 2911.0) * (value - 2.0);
+  catch (const AvisynthError& err) {
+    printf("DoViAnalyzer: %s\n", err.msg);
+    result = 1;
   }
-  else if (value < 4.0) {
-    return ((-1.0 / 41.0 * (value - 3.0) + 168.0 / 2911.0) * (value - 3.0) - 97.0 / 2911.0) * (value - 3.0);
+
+  if (!result) {
+    printf("frames: %i\n", length);
+    for (int q = 0; q < tiers; q++) {
+      printf("quality=%i: %.2f ms per frame", q, std::chrono::duration<double, std::milli>(time[q]).count() / length);
+      if (q < tiers - 1)
+        printf(", max error against quality=2: %i", maxError[q]);
+      printf("\n");
+    }
   }
-  return 0.0;
+
+  env->DeleteScriptEnvironment();
+  AVS_linkage = nullptr;
+  ::FreeLibrary(avsLib);
+  return result;
 }
 
 int main(int argc, char** argv)
@@ -322,6 +467,14 @@ int main(int argc, char** argv)
     printf("DoViAnalyzer: provide path to RPU.bin file\n");
     return 1;
   }
+
+  if (argc > 2 && std::string(argv[1]) == "-compare") {
+    return compareDecoders(argv[2]);
+  }
+
+  if (argc > 2 && std::string(argv[1]) == "-benchmark") {
+    return benchmarkQuality(argv[2], argc > 3 ? std::atoi(argv[3]) : 24);
+  }
   
   DoViProcessor dovi(argv[1], NULL);
   if (!dovi.wasCreationSuccessful()) {
@@ -332,6 +485,10 @@ int main(int argc, char** argv)
   if (argc > 2) {
     fp = fopen(argv[2], "w");
   }
+  std::unique_ptr<DoViSidecarWriter> sidecar;
+  if (argc > 3) {
+    sidecar = std::make_unique<DoViSidecarWriter>();
+  }
 
   int length = dovi.getClipLength();
   printf("clip length: %i\n", length);
@@ -340,14 +497,20 @@ int main(int argc, char** argv)
   uint16_t unusualMatrix = 0;
   uint16_t nonIdentityMapping = 0;
   for (int i = 0; i < length; i++) {
-    dovi.intializeFrame(i, NULL);
+    if (!dovi.intializeFrame(i, NULL) && sidecar) {
+      printf("\nDoViAnalyzer: frame %i cannot be decoded, no sidecar written\n", i);
+      sidecar.reset();
+    }
+    if (sidecar) {
+      sidecar->addFrame(dovi.getFrameParams(), dovi.getFrameInfo());
+    }
     int frame_max_pq = dovi.getMaxPq();
     if (frame_max_pq > clip_max_pq) {
       clip_max_pq = frame_max_pq;
     }
-    unusualMatrix |= checkMatrix(dovi);
-    nonIdentityMapping |= checkNonIdentityMapping(dovi);
-    elMixing |= checkElProcessing(dovi);
+    unusualMatrix |= dovi.checkMatrix();
+    nonIdentityMapping |= dovi.checkNonIdentityMapping();
+    elMixing |= dovi.checkElProcessing();
     if(fp && dovi.isSceneChange()){
       fputs((std::to_string(i)+" K\n").c_str(), fp);
     }
@@ -356,6 +519,9 @@ int main(int argc, char** argv)
   if (fp) {
     fclose(fp);
   }
+  if (sidecar && !sidecar->write(argv[3])) {
+    printf("DoViAnalyzer: cannot write sidecar file %s\n", argv[3]);
+  }
 
   //printf("clip max pq: %i\n", clip_max_pq);
   printf("overall max cll: %i\n", DoViProcessor::pq2nits(clip_max_pq));
@@ -1,13 +1,79 @@
 #include "DoViBaker.h"
+#include "ScratchArena.h"
 #include "cube.h"
 
 #include <array>
+#include <cmath>
+#include <emmintrin.h>
 #include <io.h>
 
 //////////////////////////////
 // Code
 //////////////////////////////
 
+// 8x8 ordered dither matrix
+static const uint8_t bayer8x8[8][8] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+// highest 12bit PQ code up to which the cube maps every color onto itself, deviations below 10bit precision are ignored
+static uint16_t findIdentityKnee(const timecube::Cube& cube)
+{
+	static const float tolerance = 1.0f / 1023;
+	const int n = cube.n;
+	float step[3];
+	for (int c = 0; c < 3; c++) {
+		if (cube.domain_min[c] > 0.0f)
+			return 0; // dark colors are clamped to the domain
+		step[c] = (cube.domain_max[c] - cube.domain_min[c]) / (n - 1);
+	}
+	auto isIdentity = [&](const float* entry, int r, int g, int b) {
+		const int idx[3] = { r, g, b };
+		for (int c = 0; c < 3; c++) {
+			if (std::fabs(entry[c] - (cube.domain_min[c] + idx[c] * step[c])) > tolerance)
+				return false;
+		}
+		return true;
+	};
+
+	// grow the identity region shell by shell, the interpolation stays within the cells of the grid points checked so far
+	int knee = -1;
+	for (int k = 0; k < n; k++) {
+		bool identity = true;
+		if (cube.is_3d) {
+			for (int b = 0; b <= k && identity; b++) {
+				for (int g = 0; g <= k && identity; g++) {
+					for (int r = 0; r <= k && identity; r++) {
+						if (b == k || g == k || r == k)
+							identity = isIdentity(&cube.lut[3 * ((b * n + g) * n + r)], r, g, b);
+					}
+				}
+			}
+		}
+		else {
+			identity = isIdentity(&cube.lut[3 * k], k, k, k);
+		}
+		if (!identity)
+			break;
+		knee = k;
+	}
+	if (knee < 0)
+		return 0;
+
+	float value = 1.0f;
+	for (int c = 0; c < 3; c++) {
+		value = min(value, cube.domain_min[c] + knee * step[c]);
+	}
+	return uint16_t(max(value, 0.0f) * 4095);
+}
+
 template<int quarterResolutionEl>
 DoViBaker<quarterResolutionEl>::DoViBaker(
 	PClip _blChild, 
@@ -16,31 +82,71 @@ DoViBaker<quarterResolutionEl>::DoViBaker(
 	bool _blChromaSubSampled, 
 	bool _elChromaSubSampled,
 	std::vector<std::pair<uint16_t, std::string>>& _cubes,
-	bool _qnd,
+	int _quality,
 	bool _rgbProof,
 	bool _nlqProof,
 	bool _outYUV,
+	int _prefetch,
+	bool _nativeRpu,
+	int _outputDepth,
+	bool _outYUV420,
+	bool _downscale,
+	UpsampleFilter _upsampleFilter,
+	bool _approxMmr,
+	bool _mmrTable,
 	IScriptEnvironment* env)
-  : GenericVideoFilter(_blChild), elChild(_elChild), qnd(_qnd), outYUV(_outYUV), blClipChromaSubSampled(_blChromaSubSampled), elClipChromaSubSampled(_elChromaSubSampled)
+  : GenericVideoFilter(_blChild), elChild(_elChild), quality(_quality), outYUV(_outYUV), outYUV420(_outYUV420), downscale(_downscale), upsampleFilter(_upsampleFilter), outputDepth(_outputDepth), blClipChromaSubSampled(_blChromaSubSampled), elClipChromaSubSampled(_elChromaSubSampled), elTileCols(0), elTileRows(0)
 {
-	int bits_per_pixel = vi.BitsPerComponent();
-	if (bits_per_pixel != DoViProcessor::containerBitDepth) {
-		env->ThrowError("DoViBaker: Video must be 16bit");
+	// the samples are read in their native depth, a conversion to 16bit beforehand is not needed
+	blInputBitDepth = vi.BitsPerComponent();
+	const int elInputBitDepth = elChild ? elChild->GetVideoInfo().BitsPerComponent() : blInputBitDepth;
+	if (blInputBitDepth < 10 || blInputBitDepth > DoViProcessor::containerBitDepth || elInputBitDepth < 10 || elInputBitDepth > DoViProcessor::containerBitDepth) {
+		env->ThrowError("DoViBaker: Video must be 10 to 16bit");
+	}
+	if (downscale) {
+		vi.width /= 2;
+		vi.height /= 2;
+	}
+	containerVi = vi;
+	containerVi.pixel_type = blClipChromaSubSampled ? VideoInfo::CS_YUV420P16 : VideoInfo::CS_YUV444P16;
+	if (outYUV420) {
+		vi.pixel_type = (outputDepth == 10) ? VideoInfo::CS_YUV420P10 : (outputDepth == 12) ? VideoInfo::CS_YUV420P12 : VideoInfo::CS_YUV420P16;
+	}
+	else if (!outYUV) {
+		vi.pixel_type = (outputDepth == 10) ? VideoInfo::CS_RGBP10 : (outputDepth == 12) ? VideoInfo::CS_RGBP12 : (outputDepth == 16) ? VideoInfo::CS_RGBP16 : VideoInfo::CS_RGBPS;
+	}
+	else if (blClipChromaSubSampled) {
+		vi.pixel_type = (outputDepth == 10) ? VideoInfo::CS_YUV420P10 : (outputDepth == 12) ? VideoInfo::CS_YUV420P12 : VideoInfo::CS_YUV420P16;
+	}
+	else {
+		vi.pixel_type = (outputDepth == 10) ? VideoInfo::CS_YUV444P10 : (outputDepth == 12) ? VideoInfo::CS_YUV444P12 : VideoInfo::CS_YUV444P16;
 	}
-	if (!outYUV)
-		vi.pixel_type = VideoInfo::CS_RGBP16;
 
-	doviProc = new DoViProcessor(rpuPath, env);
+	has_at_least_v9 = true;
+	try { env->CheckVersion(9); }
+	catch (const AvisynthError&) { has_at_least_v9 = false; }
+
+	doviProc = new DoViProcessor(rpuPath, env, _nativeRpu);
 	if (!doviProc->wasCreationSuccessful()) {
 		env->ThrowError("DoViBaker: Cannot create object");
 	}
 	doviProc->setRgbProof(_rgbProof);
 	doviProc->setNlqProof(_nlqProof);
+	doviProc->setApproxMmr(_approxMmr);
+	doviProc->setChromaTable(_mmrTable);
+	doviProc->setInputBitDepth(blInputBitDepth, elInputBitDepth);
 
 	if (vi.num_frames != doviProc->getClipLength()) {
 		env->ThrowError("DoViBaker: Clip length does not match length indicated by RPU file");
 	}
 
+	if (_prefetch > 0) {
+		doviProc->enableLookahead(_prefetch);
+		blPrefetcher = std::make_unique<FramePrefetcher>(child, _prefetch);
+		if (elChild)
+			elPrefetcher = std::make_unique<FramePrefetcher>(elChild, _prefetch, [this](int k) { return doviProc->requiresElProcessing(k); });
+	}
+
   CPU_FLAG = env->GetCPUFlags();
 	int lutMaxCpuCaps = INT_MAX;
 
@@ -51,6 +157,7 @@ DoViBaker<quarterResolutionEl>::DoViBaker(
 		}
 		timecube::Cube cube = timecube::read_cube_from_file(cube_path.c_str());
 		luts.push_back(std::pair(_cubes[i].first, timecube::create_lut_impl(cube, lutMaxCpuCaps)));
+		lutIdentityKnees.push_back(findIdentityKnee(cube));
 	}
 }
 
@@ -60,87 +167,107 @@ DoViBaker<quarterResolutionEl>::~DoViBaker()
 	doviProc->~DoViProcessor();
 }
 
-template<int quarterResolutionEl>
-template<int vertLen, int nD>
-inline void DoViBaker<quarterResolutionEl>::upsampleVert(PVideoFrame& dst, const PVideoFrame& src, const int plane, const std::array<int, vertLen>& Dn0p, const upscaler_t evenUpscaler, const upscaler_t oddUpscaler, IScriptEnvironment* env)
+// upsamples a single row horizontally into twice its width
+template<class Upsampler>
+static inline void upsampleHorzRow(uint16_t* dstP, const uint16_t* srcP, int srcWidth, const uint8_t* skipRow, int tileShift, uint16_t flatValue)
 {
-	const int srcHeight = src->GetHeight(plane);
-	const int srcWidth = src->GetRowSize(plane) / sizeof(uint16_t);
-	const int srcPitch = src->GetPitch(plane) / sizeof(uint16_t);
-	const uint16_t* srcPb = (const uint16_t*)src->GetReadPtr(plane);
-
-	const int dstPitch = dst->GetPitch(plane) / sizeof(uint16_t);
-	uint16_t* dstPeven = (uint16_t*)dst->GetWritePtr(plane);
-	uint16_t* dstPodd = dstPeven + dstPitch;
-
-	std::array<const uint16_t*, vertLen> srcP;
+	static const int vertLen = Upsampler::len;
+	static const int nD = Upsampler::nD;
+	static const int pD = vertLen - nD - 1;
+	const std::array<int, vertLen>& Dn0p = Upsampler::offsets;
 	std::array<uint16_t, vertLen> value;
-	auto& srcP0 = srcP[nD];
 
-	for (int h0 = 0; h0 < srcHeight; h0++) {
+	for (int w = nD; w < srcWidth - pD; w++) {
+		if (skipRow && skipRow[w >> tileShift]) {
+			const int wEnd = min(((w >> tileShift) + 1) << tileShift, srcWidth - pD);
+			std::fill(dstP + 2 * w, dstP + 2 * wEnd, flatValue);
+			w = wEnd - 1;
+			continue;
+		}
+		dstP[2 * w] = Upsampler::upsampleEven(&srcP[w - nD], nD);
+		dstP[2 * w + 1] = Upsampler::upsampleOdd(&srcP[w - nD], nD);
+	}
+	for (int w = 0; w < nD; w++) {
 		for (int i = 0; i < nD; i++) {
-			int factor = max(h0 + Dn0p[i], 0);
-			srcP[i] = srcPb + factor * srcPitch;
+			int wd = max(w + Dn0p[i], 0);
+			value[i] = srcP[wd];
 		}
-		srcP0 = srcPb + h0 * srcPitch;
+		std::copy_n(&srcP[w], pD + 1, &value[nD]);
+		dstP[2 * w] = Upsampler::upsampleEven(&value[0], nD);
+		dstP[2 * w + 1] = Upsampler::upsampleOdd(&value[0], nD);
+	}
+	for (int w = srcWidth - pD; w < srcWidth; w++) {
 		for (int i = nD + 1; i < vertLen; i++) {
-			int factor = min(h0 + Dn0p[i], srcHeight - 1);
-			srcP[i] = srcPb + factor * srcPitch;
+			int wd = min(w + Dn0p[i], srcWidth - 1);
+			value[i] = srcP[wd];
 		}
+		std::copy_n(&srcP[w - nD], nD + 1, &value[0]);
+		dstP[2 * w] = Upsampler::upsampleEven(&value[0], nD);
+		dstP[2 * w + 1] = Upsampler::upsampleOdd(&value[0], nD);
+	}
+}
 
-		for (int w = 0; w < srcWidth; w++) {
-			for (int i = 0; i < vertLen; i++) {
-				value[i] = srcP[i][w];
-			}
-			dstPeven[w] = evenUpscaler(&value[0], nD);
-			dstPodd[w] = oddUpscaler(&value[0], nD);
-		}
+// upsamples source row h0 of a plane into the two output rows 2 * h0 and 2 * h0 + 1, tmp holds two rows of the source width
+template<class Upsampler>
+static void upsampleRowPair(uint16_t* dstEven, uint16_t* dstOdd, const uint16_t* srcPb, int srcPitch, int srcWidth, int srcHeight, int h0, uint16_t* tmp, const uint8_t* skipRow, int tileShift, uint16_t flatValue)
+{
+	// the window and the taps are known at compile time for each kernel
+	static const int vertLen = Upsampler::len;
+	static const int nD = Upsampler::nD;
+	const std::array<int, vertLen>& Dn0p = Upsampler::offsets;
+	uint16_t* rowEven = tmp;
+	uint16_t* rowOdd = tmp + srcWidth;
+
+	// the window of source rows is clamped at the borders
+	std::array<const uint16_t*, vertLen> srcP;
+	std::array<uint16_t, vertLen> value;
+	for (int i = 0; i < vertLen; i++) {
+		int factor = min(max(h0 + Dn0p[i], 0), srcHeight - 1);
+		srcP[i] = srcPb + factor * srcPitch;
+	}
 
-		dstPeven += 2 * dstPitch;
-		dstPodd += 2 * dstPitch;
+	for (int w = 0; w < srcWidth; w++) {
+		if (skipRow && skipRow[w >> tileShift]) {
+			// the filters reproduce a constant input, so flat tiles are just filled
+			const int wEnd = min(((w >> tileShift) + 1) << tileShift, srcWidth);
+			std::fill(rowEven + w, rowEven + wEnd, flatValue);
+			std::fill(rowOdd + w, rowOdd + wEnd, flatValue);
+			w = wEnd - 1;
+			continue;
+		}
+		for (int i = 0; i < vertLen; i++) {
+			value[i] = srcP[i][w];
+		}
+		rowEven[w] = Upsampler::upsampleEven(&value[0], nD);
+		rowOdd[w] = Upsampler::upsampleOdd(&value[0], nD);
 	}
+
+	// the vertically upsampled rows are upsampled horizontally while they are still in the cache
+	upsampleHorzRow<Upsampler>(dstEven, rowEven, srcWidth, skipRow, tileShift, flatValue);
+	upsampleHorzRow<Upsampler>(dstOdd, rowOdd, srcWidth, skipRow, tileShift, flatValue);
 }
 
 template<int quarterResolutionEl>
-template<int vertLen, int nD>
-void DoViBaker<quarterResolutionEl>::upsampleHorz(PVideoFrame& dst, const PVideoFrame& src, const int plane, const std::array<int, vertLen>& Dn0p, const upscaler_t evenUpscaler, const upscaler_t oddUpscaler, IScriptEnvironment* env)
+template<class Upsampler>
+void DoViBaker<quarterResolutionEl>::upsample2x(PVideoFrame& dst, const PVideoFrame& src, const int plane, const uint8_t* skipTiles, int tileShift, uint16_t flatValue)
 {
 	const int srcHeight = src->GetHeight(plane);
 	const int srcWidth = src->GetRowSize(plane) / sizeof(uint16_t);
 	const int srcPitch = src->GetPitch(plane) / sizeof(uint16_t);
-	const uint16_t* srcP = (const uint16_t*)src->GetReadPtr(plane);
+	const uint16_t* srcPb = (const uint16_t*)src->GetReadPtr(plane);
 
 	const int dstPitch = dst->GetPitch(plane) / sizeof(uint16_t);
-	uint16_t* dstP = (uint16_t*)dst->GetWritePtr(plane);
+	uint16_t* dstPeven = (uint16_t*)dst->GetWritePtr(plane);
+	uint16_t* dstPodd = dstPeven + dstPitch;
 
-	static const int pD = vertLen - nD - 1;
-	std::array<uint16_t, vertLen> value;
+	ScratchArena::Scope scratch;
+	uint16_t* tmp = scratch.alloc<uint16_t>(2 * srcWidth);
 
-	for (int h = 0; h < srcHeight; h++) {
-		for (int w = nD; w < srcWidth - pD; w++) {
-			dstP[2 * w] = evenUpscaler(&srcP[w - nD], nD);
-			dstP[2 * w + 1] = oddUpscaler(&srcP[w - nD], nD);
-		}
-		for (int w = 0; w < nD; w++) {
-			for (int i = 0; i < nD; i++) {
-				int wd = max(w + Dn0p[i], 0);
-				value[i] = srcP[wd];
-			}
-			std::copy_n(&srcP[w], pD + 1, &value[nD]);
-			dstP[2 * w] = evenUpscaler(&value[0], nD);
-			dstP[2 * w + 1] = oddUpscaler(&value[0], nD);
-		}
-		for (int w = srcWidth - pD; w < srcWidth; w++) {
-			for (int i = nD + 1; i < Dn0p.size(); i++) {
-				int wd = min(w + Dn0p[i], srcWidth - 1);
-				value[i] = srcP[wd];
-			}
-			std::copy_n(&srcP[w - nD], nD + 1, &value[0]);
-			dstP[2 * w] = evenUpscaler(&value[0], nD);
-			dstP[2 * w + 1] = oddUpscaler(&value[0], nD);
-		}
-		srcP += srcPitch;
-		dstP += dstPitch;
+	for (int h0 = 0; h0 < srcHeight; h0++) {
+		const uint8_t* skipRow = skipTiles ? skipTiles + (h0 >> tileShift) * elTileCols : nullptr;
+		upsampleRowPair<Upsampler>(dstPeven, dstPodd, srcPb, srcPitch, srcWidth, srcHeight, h0, tmp, skipRow, tileShift, flatValue);
+		dstPeven += 2 * dstPitch;
+		dstPodd += 2 * dstPitch;
 	}
 }
 
@@ -238,34 +365,451 @@ void DoViBaker<quarterResolutionEl>::upsampleBlChroma(PVideoFrame& dst, const PV
 template<int quarterResolutionEl>
 void DoViBaker<quarterResolutionEl>::upscaleEl(PVideoFrame& dst, const PVideoFrame& src, VideoInfo dstVi, IScriptEnvironment* env)
 {
-	dstVi.width /= 2;
-	PVideoFrame mez = env->NewVideoFrame(dstVi);
+	switch (upsampleFilter) {
+	case UpsampleFilter::BILINEAR: upscaleEl<BilinearKernel>(dst, src, dstVi, env); break;
+	case UpsampleFilter::SPLINE16_EXACT: upscaleEl<Spline16ExactKernel>(dst, src, dstVi, env); break;
+	case UpsampleFilter::SPLINE36: upscaleEl<Spline36Kernel>(dst, src, dstVi, env); break;
+	default: upscaleEl<Spline16Kernel>(dst, src, dstVi, env); break;
+	}
+}
 
-	upsampleVert<5, 2>(mez, src, PLANAR_Y, { -2,-1, 0, 1, 2 }, &DoViProcessor::upsampleLumaEven, &DoViProcessor::upsampleLumaOdd, env);
-	upsampleVert<4, 1>(mez, src, PLANAR_U, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
-	upsampleVert<4, 1>(mez, src, PLANAR_V, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
-	
-	upsampleHorz<5, 2>(dst, mez, PLANAR_Y, { -2,-1, 0, 1, 2 }, &DoViProcessor::upsampleLumaEven, &DoViProcessor::upsampleLumaOdd, env);
-	upsampleHorz<4, 1>(dst, mez, PLANAR_U, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
-	upsampleHorz<4, 1>(dst, mez, PLANAR_V, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
+template<int quarterResolutionEl>
+template<class Kernel>
+void DoViBaker<quarterResolutionEl>::upscaleEl(PVideoFrame& dst, const PVideoFrame& src, VideoInfo dstVi, IScriptEnvironment* env)
+{
+	// tiles without residual in their neighbourhood are not filtered
+	const uint8_t* skip = elTileSkip.empty() ? nullptr : elTileSkip.data();
+	const int shiftY = elTileShift;
+	const int shiftUV = elTileShift - (elClipChromaSubSampled ? 1 : 0);
+
+	upsample2x<LumaUpsampler<Kernel>>(dst, src, PLANAR_Y, skip, shiftY, doviProc->getNlqOffset(0));
+	upsample2x<ChromaUpsampler<Kernel>>(dst, src, PLANAR_U, skip, shiftUV, doviProc->getNlqOffset(1));
+	upsample2x<ChromaUpsampler<Kernel>>(dst, src, PLANAR_V, skip, shiftUV, doviProc->getNlqOffset(2));
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::composeYUV420(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, const Area& area) const
+{
+	switch (upsampleFilter) {
+	case UpsampleFilter::BILINEAR: composeYUV420<BilinearKernel>(dst, blSrc, elSrc, area); break;
+	case UpsampleFilter::SPLINE16_EXACT: composeYUV420<Spline16ExactKernel>(dst, blSrc, elSrc, area); break;
+	case UpsampleFilter::SPLINE36: composeYUV420<Spline36Kernel>(dst, blSrc, elSrc, area); break;
+	default: composeYUV420<Spline16Kernel>(dst, blSrc, elSrc, area); break;
+	}
+}
+
+template<int quarterResolutionEl>
+template<class Kernel>
+void DoViBaker<quarterResolutionEl>::composeYUV420(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, const Area& area) const
+{
+	// the BL is 420 and the EL quarter size, so each EL luma row is upsampled into the two BL luma rows of one BL chroma row.
+	// the EL is upsampled row by row with the same filters as upscaleEl and composed right away, the result is identical.
+	const bool finalStore = outputDepth < DoViProcessor::containerBitDepth;
+	const int elChromaShift = elClipChromaSubSampled ? 1 : 0;
+
+	const int blPitchY = blSrc->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int blPitchUV = blSrc->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	const int widthUV = blSrc->GetRowSize(PLANAR_U) / sizeof(uint16_t);
+	const uint16_t* blYp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_Y);
+	const uint16_t* blUp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_U);
+	const uint16_t* blVp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_V);
+
+	const int elWidthY = elSrc->GetRowSize(PLANAR_Y) / sizeof(uint16_t);
+	const int elHeightY = elSrc->GetHeight(PLANAR_Y);
+	const int elPitchY = elSrc->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int elWidthUV = elSrc->GetRowSize(PLANAR_U) / sizeof(uint16_t);
+	const int elHeightUV = elSrc->GetHeight(PLANAR_U);
+	const int elPitchUV = elSrc->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	const uint16_t* elYp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_Y);
+	const uint16_t* elUp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_U);
+	const uint16_t* elVp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_V);
+
+	const int dstPitchY = dst->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int dstPitchUV = dst->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	uint16_t* dstYp = (uint16_t*)dst->GetWritePtr(PLANAR_Y);
+	uint16_t* dstUp = (uint16_t*)dst->GetWritePtr(PLANAR_U);
+	uint16_t* dstVp = (uint16_t*)dst->GetWritePtr(PLANAR_V);
+
+	// the area is aligned to the chroma subsampling
+	const int huvBegin = area.top >> 1;
+	const int huvEnd = area.bottom >> 1;
+	const int wuvBegin = area.left >> 1;
+	const int wuvEnd = area.right >> 1;
+
+	ScratchArena::Scope scratch;
+	uint16_t* tmp = scratch.alloc<uint16_t>(2 * elWidthY);
+	uint16_t* elY[2] = { scratch.alloc<uint16_t>(2 * elWidthY), scratch.alloc<uint16_t>(2 * elWidthY) };
+	// a 420 EL chroma row gives the EL chroma of two BL chroma rows
+	uint16_t* elU[2] = { scratch.alloc<uint16_t>(2 * elWidthUV), scratch.alloc<uint16_t>(2 * elWidthUV) };
+	uint16_t* elV[2] = { scratch.alloc<uint16_t>(2 * elWidthUV), scratch.alloc<uint16_t>(2 * elWidthUV) };
+	uint16_t* mmrRow = scratch.alloc<uint16_t>(widthUV);
+	uint16_t* mappedU = scratch.alloc<uint16_t>(widthUV);
+	uint16_t* mappedV = scratch.alloc<uint16_t>(widthUV);
+
+	// tiles without residual in their neighbourhood are not filtered
+	const uint8_t* skip = elTileSkip.empty() ? nullptr : elTileSkip.data();
+	const int shiftUV = elTileShift - elChromaShift;
+
+	for (int huv = huvBegin; huv < huvEnd; huv++) {
+		const uint8_t* skipRowY = skip ? skip + (huv >> elTileShift) * elTileCols : nullptr;
+		upsampleRowPair<LumaUpsampler<Kernel>>(elY[0], elY[1], elYp, elPitchY, elWidthY, elHeightY, huv, tmp, skipRowY, elTileShift, doviProc->getNlqOffset(0));
+
+		const uint16_t* elUrow = elUp + elPitchUV * huv;
+		const uint16_t* elVrow = elVp + elPitchUV * huv;
+		if (elClipChromaSubSampled) {
+			if ((huv & 1) == 0 || huv == huvBegin) {
+				const int he = huv >> 1;
+				const uint8_t* skipRowUV = skip ? skip + (he >> shiftUV) * elTileCols : nullptr;
+				upsampleRowPair<ChromaUpsampler<Kernel>>(elU[0], elU[1], elUp, elPitchUV, elWidthUV, elHeightUV, he, tmp, skipRowUV, shiftUV, doviProc->getNlqOffset(1));
+				upsampleRowPair<ChromaUpsampler<Kernel>>(elV[0], elV[1], elVp, elPitchUV, elWidthUV, elHeightUV, he, tmp, skipRowUV, shiftUV, doviProc->getNlqOffset(2));
+			}
+			elUrow = elU[huv & 1];
+			elVrow = elV[huv & 1];
+		}
+
+		for (int j = 0; j < 2; j++) {
+			const uint16_t* blY = blYp + blPitchY * (2 * huv + j);
+			uint16_t* dstY = dstYp + dstPitchY * (2 * huv + j);
+			for (int w = area.left; w < area.right; w++) {
+				dstY[w] = doviProc->processSampleY(blY[w], elY[j][w]);
+			}
+			if (finalStore) {
+				ditherRow(dstY, area.left, area.right, 2 * huv + j);
+			}
+		}
+
+		const uint16_t* blU = blUp + blPitchUV * huv;
+		const uint16_t* blV = blVp + blPitchUV * huv;
+		uint16_t* dstU = dstUp + dstPitchUV * huv;
+		uint16_t* dstV = dstVp + dstPitchUV * huv;
+		downsampleLuma(mmrRow, widthUV, blSrc, huv, huv + 1, true);
+		const bool mapped = doviProc->mapChromaRow(mappedU, mappedV, mmrRow + wuvBegin, blU + wuvBegin, blV + wuvBegin, wuvEnd - wuvBegin);
+		for (int wuv = wuvBegin; wuv < wuvEnd; wuv++) {
+			if (mapped) {
+				dstU[wuv] = doviProc->processMappedSampleU(mappedU[wuv - wuvBegin], elUrow[wuv]);
+				dstV[wuv] = doviProc->processMappedSampleV(mappedV[wuv - wuvBegin], elVrow[wuv]);
+				continue;
+			}
+			dstU[wuv] = doviProc->processSampleU(blU[wuv], elUrow[wuv], mmrRow[wuv], blU[wuv], blV[wuv]);
+			dstV[wuv] = doviProc->processSampleV(blV[wuv], elVrow[wuv], mmrRow[wuv], blU[wuv], blV[wuv]);
+		}
+		if (finalStore) {
+			ditherRow(dstU, wuvBegin, wuvEnd, huv);
+			ditherRow(dstV, wuvBegin, wuvEnd, huv);
+		}
+	}
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::downscaleBl(PVideoFrame& dst, const PVideoFrame& src) const
+{
+	// spline16 for a 2:1 reduction, center aligned, the output sample lies between the input samples 0 and 1
+	static const int taps = 8;
+	static const int nD = 3;
+	static const int32_t lumaWeights[taps] = { -83, -147, 531, 1747, 1747, 531, -147, -83 }; // sum 4096
+	// 420 chroma is top-left sited, it stays on the even output luma samples when it lies a quarter past input sample 0
+	static const int32_t chromaWeights[taps] = { -124, -95, 852, 1943, 1484, 239, -164, -39 }; // sum 4096
+	const int maxValue = (1 << blInputBitDepth) - 1;
+
+	// madd works on signed 16bit, the samples are biased by 0x8000 and the weights sum up to 4096
+	const __m128i bias16 = _mm_set1_epi16(-0x8000);
+	const __m128i vertOffset = _mm_set1_epi32((0x8000 << 12) + 2048);
+	const __m128i round = _mm_set1_epi32(2048);
+	const __m128i lowByte = _mm_set1_epi32(0xFF);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i maxV = _mm_set1_epi32(maxValue);
+	const __m128i bias32 = _mm_set1_epi32(0x8000);
+
+	const int planes[] = { PLANAR_Y, PLANAR_U, PLANAR_V };
+	for (int plane : planes) {
+		const int32_t* weights = (plane != PLANAR_Y && blClipChromaSubSampled) ? chromaWeights : lumaWeights;
+		__m128i weightPairs[taps / 2];
+		for (int t = 0; t < taps / 2; t++) {
+			weightPairs[t] = _mm_set1_epi32((weights[2 * t + 1] << 16) | (weights[2 * t] & 0xFFFF));
+		}
+		const __m128i weightRow = _mm_setr_epi16(weights[0], weights[1], weights[2], weights[3], weights[4], weights[5], weights[6], weights[7]);
+
+		const int srcHeight = src->GetHeight(plane);
+		const int srcWidth = src->GetRowSize(plane) / sizeof(uint16_t);
+		const int srcPitch = src->GetPitch(plane) / sizeof(uint16_t);
+		const uint16_t* srcPb = (const uint16_t*)src->GetReadPtr(plane);
+
+		const int dstHeight = dst->GetHeight(plane);
+		const int dstWidth = dst->GetRowSize(plane) / sizeof(uint16_t);
+		const int dstPitch = dst->GetPitch(plane) / sizeof(uint16_t);
+		uint16_t* dstP = (uint16_t*)dst->GetWritePtr(plane);
+
+		// the vertically filtered row may exceed 16bit, it is kept split into its upper bits and its low byte,
+		// both fit the 16bit lanes of madd. the row is padded at both ends for the horizontal taps
+		ScratchArena::Scope scratch;
+		int16_t* rowHi = scratch.alloc<int16_t>(srcWidth + taps) + nD;
+		int16_t* rowLo = scratch.alloc<int16_t>(srcWidth + taps) + nD;
+		std::array<const uint16_t*, taps> srcP;
+
+		auto vertScalar = [&](int w) -> int32_t {
+			int32_t sum = 2048;
+			for (int t = 0; t < taps; t++) {
+				sum += weights[t] * srcP[t][w];
+			}
+			return sum >> 12;
+		};
+		auto horzScalar = [&](int w) -> int32_t {
+			int32_t hi = 0, lo = 0;
+			for (int t = 0; t < taps; t++) {
+				hi += weights[t] * rowHi[2 * w - nD + t];
+				lo += weights[t] * rowLo[2 * w - nD + t];
+			}
+			return (hi * 256 + lo + 2048) >> 12;
+		};
+		// the taps of four outputs, each starts two input samples after the previous one
+		auto horz4 = [&](int w) -> __m128i {
+			__m128i m[4];
+			for (int i = 0; i < 4; i++) {
+				const int x = 2 * (w + i) - nD;
+				const __m128i hi = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(rowHi + x)), weightRow);
+				const __m128i lo = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(rowLo + x)), weightRow);
+				m[i] = _mm_add_epi32(_mm_slli_epi32(hi, 8), lo);
+			}
+			// transpose and add, lane i holds the sum of m[i]
+			const __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(m[0], m[1]), _mm_unpackhi_epi32(m[0], m[1]));
+			const __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(m[2], m[3]), _mm_unpackhi_epi32(m[2], m[3]));
+			__m128i v = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23)), round), 12);
+			v = _mm_andnot_si128(_mm_cmplt_epi32(v, zero), v);
+			const __m128i over = _mm_cmpgt_epi32(v, maxV);
+			v = _mm_or_si128(_mm_and_si128(over, maxV), _mm_andnot_si128(over, v));
+			return _mm_sub_epi32(v, bias32);
+		};
+
+		for (int h = 0; h < dstHeight; h++) {
+			for (int t = 0; t < taps; t++) {
+				const int hs = min(max(2 * h - nD + t, 0), srcHeight - 1);
+				srcP[t] = srcPb + hs * srcPitch;
+			}
+			int w = 0;
+			for (; w + 8 <= srcWidth; w += 8) {
+				__m128i acc[2] = { vertOffset, vertOffset };
+				for (int t = 0; t < taps / 2; t++) {
+					const __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(srcP[2 * t] + w)), bias16);
+					const __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(srcP[2 * t + 1] + w)), bias16);
+					acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weightPairs[t]));
+					acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weightPairs[t]));
+				}
+				acc[0] = _mm_srai_epi32(acc[0], 12);
+				acc[1] = _mm_srai_epi32(acc[1], 12);
+				_mm_storeu_si128((__m128i*)(rowHi + w), _mm_packs_epi32(_mm_srai_epi32(acc[0], 8), _mm_srai_epi32(acc[1], 8)));
+				_mm_storeu_si128((__m128i*)(rowLo + w), _mm_packs_epi32(_mm_and_si128(acc[0], lowByte), _mm_and_si128(acc[1], lowByte)));
+			}
+			for (; w < srcWidth; w++) {
+				const int32_t v = vertScalar(w);
+				rowHi[w] = int16_t(v >> 8);
+				rowLo[w] = int16_t(v & 0xFF);
+			}
+			for (int t = 0; t < nD; t++) {
+				rowHi[-1 - t] = rowHi[0];
+				rowLo[-1 - t] = rowLo[0];
+			}
+			for (int t = 0; t < taps - nD; t++) {
+				rowHi[srcWidth + t] = rowHi[srcWidth - 1];
+				rowLo[srcWidth + t] = rowLo[srcWidth - 1];
+			}
+
+			w = 0;
+			for (; w + 8 <= dstWidth; w += 8) {
+				// the results are biased around the signed saturation of packs
+				const __m128i res = _mm_packs_epi32(horz4(w), horz4(w + 4));
+				_mm_storeu_si128((__m128i*)(dstP + w), _mm_xor_si128(res, bias16));
+			}
+			for (; w < dstWidth; w++) {
+				const int32_t sum = horzScalar(w);
+				dstP[w] = sum < 0 ? 0 : (sum > maxValue ? maxValue : sum);
+			}
+			dstP += dstPitch;
+		}
+	}
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::widenBl(PVideoFrame& dst, const PVideoFrame& src) const
+{
+	// the identity composition only moves the BL samples to the container depth
+	const int shift = DoViProcessor::containerBitDepth - blInputBitDepth;
+	const int planes[] = { PLANAR_Y, PLANAR_U, PLANAR_V };
+	for (int plane : planes) {
+		const int height = src->GetHeight(plane);
+		const int width = src->GetRowSize(plane) / sizeof(uint16_t);
+		const int srcPitch = src->GetPitch(plane) / sizeof(uint16_t);
+		const int dstPitch = dst->GetPitch(plane) / sizeof(uint16_t);
+		const uint16_t* srcP = (const uint16_t*)src->GetReadPtr(plane);
+		uint16_t* dstP = (uint16_t*)dst->GetWritePtr(plane);
+		for (int h = 0; h < height; h++) {
+			for (int w = 0; w < width; w++) {
+				dstP[w] = srcP[w] << shift;
+			}
+			srcP += srcPitch;
+			dstP += dstPitch;
+		}
+	}
+}
+
+static inline bool isFlatRun(const uint16_t* p, int n, __m128i ref, uint16_t value)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(x, ref)) != 0xFFFF)
+			return false;
+	}
+	for (; i < n; i++) {
+		if (p[i] != value)
+			return false;
+	}
+	return true;
+}
+
+template<int quarterResolutionEl>
+int DoViBaker<quarterResolutionEl>::findFlatElTiles(const PVideoFrame& el)
+{
+	const int width = el->GetRowSize(PLANAR_Y) / sizeof(uint16_t);
+	const int height = el->GetHeight(PLANAR_Y);
+	const int tileSize = 1 << elTileShift;
+	elTileCols = (width + tileSize - 1) >> elTileShift;
+	elTileRows = (height + tileSize - 1) >> elTileShift;
+	elTileFlat.assign(elTileCols * elTileRows, 1);
+
+	// a sample equal to the nlq offset of its component has no residual
+	const int planes[] = { PLANAR_Y, PLANAR_U, PLANAR_V };
+	for (int cmp = 0; cmp < 3; cmp++) {
+		const int plane = planes[cmp];
+		const int shift = elTileShift - ((cmp && elClipChromaSubSampled) ? 1 : 0);
+		const int planeWidth = el->GetRowSize(plane) / sizeof(uint16_t);
+		const int planeHeight = el->GetHeight(plane);
+		const int pitch = el->GetPitch(plane) / sizeof(uint16_t);
+		const uint16_t* srcP = (const uint16_t*)el->GetReadPtr(plane);
+		const uint16_t offset = doviProc->getNlqOffset(cmp);
+		const __m128i ref = _mm_set1_epi16(offset);
+
+		for (int h = 0; h < planeHeight; h++) {
+			uint8_t* flat = &elTileFlat[(h >> shift) * elTileCols];
+			for (int t = 0; t < elTileCols; t++) {
+				if (!flat[t])
+					continue;
+				const int w0 = t << shift;
+				const int w1 = min(w0 + (1 << shift), planeWidth);
+				flat[t] = isFlatRun(srcP + w0, w1 - w0, ref, offset);
+			}
+			srcP += pitch;
+		}
+	}
+
+	int numResidualTiles = 0;
+	for (uint8_t flat : elTileFlat) {
+		numResidualTiles += !flat;
+	}
+
+	// the upscaling filters reach into the neighbouring tiles, only tiles surrounded by flat tiles can be skipped
+	elTileSkip.clear();
+	if (quarterResolutionEl && numResidualTiles > 0) {
+		elTileSkip.assign(elTileCols * elTileRows, 0);
+		for (int ty = 0; ty < elTileRows; ty++) {
+			for (int tx = 0; tx < elTileCols; tx++) {
+				bool skip = true;
+				for (int dy = max(ty - 1, 0); dy <= min(ty + 1, elTileRows - 1) && skip; dy++) {
+					for (int dx = max(tx - 1, 0); dx <= min(tx + 1, elTileCols - 1) && skip; dx++) {
+						skip = elTileFlat[dy * elTileCols + dx];
+					}
+				}
+				elTileSkip[ty * elTileCols + tx] = skip;
+			}
+		}
+	}
+	return numResidualTiles;
 }
 
 template<int quarterResolutionEl>
 void DoViBaker<quarterResolutionEl>::upsampleChroma(PVideoFrame& dst, const PVideoFrame& src, VideoInfo dstVi, IScriptEnvironment* env)
 {
-	dstVi.width /= 2;
-	PVideoFrame mez = env->NewVideoFrame(dstVi);
+	switch (upsampleFilter) {
+	case UpsampleFilter::BILINEAR: upsampleChroma<BilinearKernel>(dst, src, dstVi, env); break;
+	case UpsampleFilter::SPLINE16_EXACT: upsampleChroma<Spline16ExactKernel>(dst, src, dstVi, env); break;
+	case UpsampleFilter::SPLINE36: upsampleChroma<Spline36Kernel>(dst, src, dstVi, env); break;
+	default: upsampleChroma<Spline16Kernel>(dst, src, dstVi, env); break;
+	}
+}
 
-	upsampleVert<4, 1>(mez, src, PLANAR_U, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
-	upsampleVert<4, 1>(mez, src, PLANAR_V, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
+template<int quarterResolutionEl>
+template<class Kernel>
+void DoViBaker<quarterResolutionEl>::upsampleChroma(PVideoFrame& dst, const PVideoFrame& src, VideoInfo dstVi, IScriptEnvironment* env)
+{
+	upsample2x<ChromaUpsampler<Kernel>>(dst, src, PLANAR_U);
+	upsample2x<ChromaUpsampler<Kernel>>(dst, src, PLANAR_V);
+}
 
-	upsampleHorz<4, 1>(dst, mez, PLANAR_U, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
-	upsampleHorz<4, 1>(dst, mez, PLANAR_V, { -1, 0, 1, 2 }, &DoViProcessor::upsampleChromaEven, &DoViProcessor::upsampleChromaOdd, env);
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::downsampleLuma(uint16_t* dst, int dstPitch, const PVideoFrame& src, int huvBegin, int huvEnd, bool repeatLastColumn) const
+{
+	// luma at the left sited chroma: [1 2 1] horizontally in both rows of the chroma sample, the rows are averaged
+	// with repeatLastColumn the last chroma sample uses its own luma as right neighbour, as the full composition always did
+	const int width = src->GetRowSize(PLANAR_Y) / sizeof(uint16_t);
+	const int widthUV = src->GetRowSize(PLANAR_U) / sizeof(uint16_t);
+	const int srcPitch = src->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const uint16_t* srcP = (const uint16_t*)src->GetReadPtr(PLANAR_Y) + srcPitch * 2 * huvBegin;
+
+	auto downsample = [&](const uint16_t* y0, const uint16_t* y1, int wuv) -> uint16_t {
+		const int w = 2 * wuv;
+		const int wl = max(w - 1, 0);
+		const int wr = (repeatLastColumn && wuv == widthUV - 1) ? w : min(w + 1, width - 1);
+		const int a = (y0[wl] + 2 * y0[w] + y0[wr] + 2) >> 2;
+		const int b = (y1[wl] + 2 * y1[w] + y1[wr] + 2) >> 2;
+		return (a + b + 1) >> 1;
+	};
+
+	const __m128i lowMask = _mm_set1_epi32(0xFFFF);
+	const __m128i two = _mm_set1_epi32(2);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i bias32 = _mm_set1_epi32(0x8000);
+	const __m128i bias16 = _mm_set1_epi16(-0x8000);
+
+	// the four even and odd luma samples of a row, and the odd sample in front of them
+	auto rowSum = [&](const uint16_t* y, int w) -> __m128i {
+		const __m128i s = _mm_loadu_si128((const __m128i*)(y + w));
+		const __m128i even = _mm_and_si128(s, lowMask);
+		const __m128i odd = _mm_srli_epi32(s, 16);
+		const __m128i oddPrev = _mm_or_si128(_mm_slli_si128(odd, 4), _mm_cvtsi32_si128(y[w - 1]));
+		const __m128i sum = _mm_add_epi32(_mm_add_epi32(oddPrev, odd), _mm_add_epi32(_mm_slli_epi32(even, 1), two));
+		return _mm_srli_epi32(sum, 2);
+	};
+
+	for (int huv = huvBegin; huv < huvEnd; huv++) {
+		const uint16_t* y0 = srcP;
+		const uint16_t* y1 = srcP + srcPitch;
+
+		// the first and last chroma samples need clamped neighbours
+		dst[0] = downsample(y0, y1, 0);
+		int wuv = 1;
+		for (; wuv + 8 < widthUV; wuv += 8) {
+			__m128i res[2];
+			for (int i = 0; i < 2; i++) {
+				const int w = 2 * (wuv + 4 * i);
+				const __m128i a = rowSum(y0, w);
+				const __m128i b = rowSum(y1, w);
+				res[i] = _mm_sub_epi32(_mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(a, b), one), 1), bias32);
+			}
+			// the results fit into 16bit, packs saturates signed, so they are biased around it
+			_mm_storeu_si128((__m128i*)(dst + wuv), _mm_xor_si128(_mm_packs_epi32(res[0], res[1]), bias16));
+		}
+		for (; wuv < widthUV; wuv++) {
+			dst[wuv] = downsample(y0, y1, wuv);
+		}
+
+		srcP += 2 * srcPitch;
+		dst += dstPitch;
+	}
 }
 
 template<int quarterResolutionEl>
 template<int chromaSubsampling>
-void DoViBaker<quarterResolutionEl>::applyDovi(PVideoFrame& dst, const PVideoFrame& blSrcY, const PVideoFrame& blSrcUV, const PVideoFrame& elSrcY, const PVideoFrame& elSrcUV, IScriptEnvironment* env) const {
+void DoViBaker<quarterResolutionEl>::applyDovi(PVideoFrame& dst, const PVideoFrame& blSrcY, const PVideoFrame& blSrcUV, const PVideoFrame& elSrcY, const PVideoFrame& elSrcUV, const Area& area, bool finalStore, IScriptEnvironment* env) const {
+	finalStore = finalStore && outputDepth < DoViProcessor::containerBitDepth;
 
 	const int blSrcPitchY = blSrcY->GetPitch(PLANAR_Y) / sizeof(uint16_t);
 
@@ -286,10 +830,15 @@ void DoViBaker<quarterResolutionEl>::applyDovi(PVideoFrame& dst, const PVideoFra
 		dstYp[1] = dstYp[0] + dstPitchY;
 	}
 
-	const int blSrcHeightUV = blSrcUV->GetHeight(PLANAR_U);
 	const int blSrcWidthUV = blSrcUV->GetRowSize(PLANAR_U) / sizeof(uint16_t);
 	const int blSrcPitchUV = blSrcUV->GetPitch(PLANAR_U) / sizeof(uint16_t);
 
+	// the area is aligned to the chroma subsampling
+	const int huvBegin = area.top >> chromaSubsampling;
+	const int huvEnd = area.bottom >> chromaSubsampling;
+	const int wuvBegin = area.left >> chromaSubsampling;
+	const int wuvEnd = area.right >> chromaSubsampling;
+
 	const int elSrcPitchUV = elSrcUV->GetPitch(PLANAR_U) / sizeof(uint16_t);
 
 	const int dstPitchUV = dst->GetPitch(PLANAR_U) / sizeof(uint16_t);
@@ -302,57 +851,55 @@ void DoViBaker<quarterResolutionEl>::applyDovi(PVideoFrame& dst, const PVideoFra
 	const uint16_t* elSrcVp = (const uint16_t*)elSrcUV->GetReadPtr(PLANAR_V);
 	uint16_t* dstVp = (uint16_t*)dst->GetWritePtr(PLANAR_V);
 
-	for (int huv = 0; huv < blSrcHeightUV; huv++) {
-		if (chromaSubsampling) {
-			int wuv = 0;
-			for (int j = 0; j < chromaSubsampling + 1; j++) {
-				for (int i = 0; i < chromaSubsampling + 1; i++) {
-					const int w = (chromaSubsampling + 1) * wuv + i;
-					dstYp[j][w] = doviProc->processSampleY(blSrcYp[j][w], elSrcYp[j][w]);
-				}
-			}
-			int mmrBlY1 = 3 * blSrcYp[0][2 * wuv] + blSrcYp[0][2 * wuv + 1] + 2;
-			int mmrBlY2 = 3 * blSrcYp[1][2 * wuv] + blSrcYp[1][2 * wuv + 1] + 2;
-			uint16_t mmrBlY = ((mmrBlY1 >> 2) + (mmrBlY2 >> 2) + 1) >> 1;
+	for (int i = 0; i < chromaSubsampling + 1; i++) {
+		blSrcYp[i] += blSrcPitchY * area.top;
+		elSrcYp[i] += elSrcPitchY * area.top;
+		dstYp[i] += dstPitchY * area.top;
+	}
+	blSrcUp += blSrcPitchUV * huvBegin;
+	blSrcVp += blSrcPitchUV * huvBegin;
+	elSrcUp += elSrcPitchUV * huvBegin;
+	elSrcVp += elSrcPitchUV * huvBegin;
+	dstUp += dstPitchUV * huvBegin;
+	dstVp += dstPitchUV * huvBegin;
+
+	// the luma of the chroma sites which feeds the mmr is prepared for the whole area in one pass
+	ScratchArena::Scope scratch;
+	uint16_t* mmrLuma = nullptr;
+	if (chromaSubsampling) {
+		mmrLuma = scratch.alloc<uint16_t>(blSrcWidthUV * (huvEnd - huvBegin));
+		downsampleLuma(mmrLuma, blSrcWidthUV, blSrcY, huvBegin, huvEnd, true);
+	}
+	uint16_t* mappedU = scratch.alloc<uint16_t>(wuvEnd - wuvBegin);
+	uint16_t* mappedV = scratch.alloc<uint16_t>(wuvEnd - wuvBegin);
 
-			dstUp[wuv] = doviProc->processSampleU(blSrcUp[wuv], elSrcUp[wuv], mmrBlY, blSrcUp[wuv], blSrcVp[wuv]);
-			dstVp[wuv] = doviProc->processSampleV(blSrcVp[wuv], elSrcVp[wuv], mmrBlY, blSrcUp[wuv], blSrcVp[wuv]);
-		}
+	for (int huv = huvBegin; huv < huvEnd; huv++) {
+		const uint16_t* mmrBlYp = chromaSubsampling ? mmrLuma + blSrcWidthUV * (huv - huvBegin) : blSrcYp[0];
+		const bool mapped = doviProc->mapChromaRow(mappedU, mappedV, mmrBlYp + wuvBegin, blSrcUp + wuvBegin, blSrcVp + wuvBegin, wuvEnd - wuvBegin);
 
-		for (int wuv = chromaSubsampling; wuv < blSrcWidthUV - chromaSubsampling; wuv++) {
+		for (int wuv = wuvBegin; wuv < wuvEnd; wuv++) {
 			for (int j = 0; j < chromaSubsampling + 1; j++) {
 				for (int i = 0; i < chromaSubsampling + 1; i++) {
 					const int w = (chromaSubsampling + 1) * wuv + i;
 					dstYp[j][w] = doviProc->processSampleY(blSrcYp[j][w], elSrcYp[j][w]);
 				}
 			}
-			uint16_t mmrBlY;
-			if (chromaSubsampling) {
-				int mmrBlY1 = blSrcYp[0][2 * wuv - 1] + 2 * blSrcYp[0][2 * wuv] + blSrcYp[0][2 * wuv + 1] + 2;
-				int mmrBlY2 = blSrcYp[1][2 * wuv - 1] + 2 * blSrcYp[1][2 * wuv] + blSrcYp[1][2 * wuv + 1] + 2;
-				mmrBlY = ((mmrBlY1 >> 2) + (mmrBlY2 >> 2) + 1) >> 1;
-			}
-			else {
-				mmrBlY = blSrcYp[0][wuv];
+			if (mapped) {
+				dstUp[wuv] = doviProc->processMappedSampleU(mappedU[wuv - wuvBegin], elSrcUp[wuv]);
+				dstVp[wuv] = doviProc->processMappedSampleV(mappedV[wuv - wuvBegin], elSrcVp[wuv]);
+				continue;
 			}
+			const uint16_t mmrBlY = mmrBlYp[wuv];
 			dstUp[wuv] = doviProc->processSampleU(blSrcUp[wuv], elSrcUp[wuv], mmrBlY, blSrcUp[wuv], blSrcVp[wuv]);
 			dstVp[wuv] = doviProc->processSampleV(blSrcVp[wuv], elSrcVp[wuv], mmrBlY, blSrcUp[wuv], blSrcVp[wuv]);
 		}
 
-		if (chromaSubsampling) {
-			int wuv = blSrcWidthUV - chromaSubsampling;
-			for (int j = 0; j < chromaSubsampling + 1; j++) {
-				for (int i = 0; i < chromaSubsampling + 1; i++) {
-					const int w = (chromaSubsampling + 1) * wuv + i;
-					dstYp[j][w] = doviProc->processSampleY(blSrcYp[j][w], elSrcYp[j][w]);
-				}
+		if (finalStore) {
+			for (int i = 0; i < chromaSubsampling + 1; i++) {
+				ditherRow(dstYp[i], area.left, area.right, (huv << chromaSubsampling) + i);
 			}
-			int mmrBlY1 = blSrcYp[0][2 * wuv - 1] + 3 * blSrcYp[0][2 * wuv] + 2;
-			int mmrBlY2 = blSrcYp[1][2 * wuv - 1] + 3 * blSrcYp[1][2 * wuv] + 2;
-			uint16_t mmrBlY = ((mmrBlY1 >> 2) + (mmrBlY2 >> 2) + 1) >> 1;
-
-			dstUp[wuv] = doviProc->processSampleU(blSrcUp[wuv], elSrcUp[wuv], mmrBlY, blSrcUp[wuv], blSrcVp[wuv]);
-			dstVp[wuv] = doviProc->processSampleV(blSrcVp[wuv], elSrcVp[wuv], mmrBlY, blSrcUp[wuv], blSrcVp[wuv]);
+			ditherRow(dstUp, wuvBegin, wuvEnd, huv);
+			ditherRow(dstVp, wuvBegin, wuvEnd, huv);
 		}
 
 		for (int i = 0; i < chromaSubsampling + 1; i++) {
@@ -370,123 +917,297 @@ void DoViBaker<quarterResolutionEl>::applyDovi(PVideoFrame& dst, const PVideoFra
 }
 
 template<int quarterResolutionEl>
-template<int blChromaSubsampling, int elChromaSubsampling>
-void DoViBaker<quarterResolutionEl>::doAllQuickAndDirty(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, IScriptEnvironment* env) const {
-	const int blSrcPitchY = blSrc->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+template<int blChromaSubsampling, int elChromaSubsampling, int elQuarterResolution>
+void DoViBaker<quarterResolutionEl>::doAllQuickAndDirty(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, bool finalStore, IScriptEnvironment* env) const {
+	finalStore = finalStore && outputDepth < DoViProcessor::containerBitDepth;
+	// the frame is composed row by row, the chroma once per chroma row, and all samples are taken nearest neighbour
+	const int width = blSrc->GetRowSize(PLANAR_Y) / sizeof(uint16_t);
+	const int height = blSrc->GetHeight(PLANAR_Y);
+	const int widthUV = blSrc->GetRowSize(PLANAR_U) / sizeof(uint16_t);
 
+	const int blSrcPitchY = blSrc->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int blSrcPitchUV = blSrc->GetPitch(PLANAR_U) / sizeof(uint16_t);
 	const int elSrcPitchY = elSrc->GetPitch(PLANAR_Y) / sizeof(uint16_t);
-
+	const int elSrcPitchUV = elSrc->GetPitch(PLANAR_U) / sizeof(uint16_t);
 	const int dstPitch = dst->GetPitch(PLANAR_R) / sizeof(uint16_t);
 
-	const int blSrcPitchUV = blSrc->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	const uint16_t* blSrcYp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_Y);
+	const uint16_t* blSrcUp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_U);
+	const uint16_t* blSrcVp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_V);
+	const uint16_t* elSrcYp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_Y);
+	const uint16_t* elSrcUp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_U);
+	const uint16_t* elSrcVp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_V);
+	uint16_t* dstRp = (uint16_t*)dst->GetWritePtr(PLANAR_R);
+	uint16_t* dstGp = (uint16_t*)dst->GetWritePtr(PLANAR_G);
+	uint16_t* dstBp = (uint16_t*)dst->GetWritePtr(PLANAR_B);
 
-	const int elSrcHeightUV = elSrc->GetHeight(PLANAR_U);
-	const int elSrcWidthUV = elSrc->GetRowSize(PLANAR_U) / sizeof(uint16_t);
+	// shifts from BL luma coordinates to the EL planes
+	const int elYShift = elQuarterResolution;
+	const int elUVShift = elQuarterResolution + elChromaSubsampling;
+
+	ScratchArena::Scope scratch;
+	uint16_t* yRow = scratch.alloc<uint16_t>(width);
+	uint16_t* uRow = scratch.alloc<uint16_t>(widthUV);
+	uint16_t* vRow = scratch.alloc<uint16_t>(widthUV);
+
+	for (int h = 0; h < height; h++) {
+		const uint16_t* blY = blSrcYp + blSrcPitchY * h;
+		const uint16_t* elY = elSrcYp + elSrcPitchY * (h >> elYShift);
+
+		if ((h & ((1 << blChromaSubsampling) - 1)) == 0) {
+			// the mmr luma is the top left luma sample of the chroma sample
+			const uint16_t* blU = blSrcUp + blSrcPitchUV * (h >> blChromaSubsampling);
+			const uint16_t* blV = blSrcVp + blSrcPitchUV * (h >> blChromaSubsampling);
+			const uint16_t* elU = elSrcUp + elSrcPitchUV * (h >> elUVShift);
+			const uint16_t* elV = elSrcVp + elSrcPitchUV * (h >> elUVShift);
+			for (int wuv = 0; wuv < widthUV; wuv++) {
+				const int wy = wuv << blChromaSubsampling;
+				const int weluv = wy >> elUVShift;
+				uRow[wuv] = doviProc->processSampleU(blU[wuv], elU[weluv], blY[wy], blU[wuv], blV[wuv]);
+				vRow[wuv] = doviProc->processSampleV(blV[wuv], elV[weluv], blY[wy], blU[wuv], blV[wuv]);
+			}
+		}
+
+		for (int w = 0; w < width; w++) {
+			yRow[w] = doviProc->processSampleY(blY[w], elY[w >> elYShift]);
+		}
+
+		uint16_t* dstR = dstRp + dstPitch * h;
+		uint16_t* dstG = dstGp + dstPitch * h;
+		uint16_t* dstB = dstBp + dstPitch * h;
+		doviProc->sample2rgbRow(dstR, dstG, dstB, yRow, uRow, vRow, width, blChromaSubsampling);
+		if (finalStore) {
+			ditherRow(dstR, 0, width, h);
+			ditherRow(dstG, 0, width, h);
+			ditherRow(dstB, 0, width, h);
+		}
+	}
+}
+
+template<int quarterResolutionEl>
+template<int blChromaSubsampling, int elChromaSubsampling, int elQuarterResolution>
+void DoViBaker<quarterResolutionEl>::doAllBilinear(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, bool finalStore, IScriptEnvironment* env) const {
+	finalStore = finalStore && outputDepth < DoViProcessor::containerBitDepth;
+	// like doAllQuickAndDirty, but the EL and the chroma are interpolated bilinearly within the row loop instead of upsampled in separate passes
+	const int width = blSrc->GetRowSize(PLANAR_Y) / sizeof(uint16_t);
+	const int height = blSrc->GetHeight(PLANAR_Y);
+	const int widthUV = blSrc->GetRowSize(PLANAR_U) / sizeof(uint16_t);
+	const int heightUV = blSrc->GetHeight(PLANAR_U);
+	const int elWidthY = elSrc->GetRowSize(PLANAR_Y) / sizeof(uint16_t);
+	const int elHeightY = elSrc->GetHeight(PLANAR_Y);
+	const int elWidthUV = elSrc->GetRowSize(PLANAR_U) / sizeof(uint16_t);
+	const int elHeightUV = elSrc->GetHeight(PLANAR_U);
+
+	const int blSrcPitchY = blSrc->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int blSrcPitchUV = blSrc->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	const int elSrcPitchY = elSrc->GetPitch(PLANAR_Y) / sizeof(uint16_t);
 	const int elSrcPitchUV = elSrc->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	const int dstPitch = dst->GetPitch(PLANAR_R) / sizeof(uint16_t);
 
-	const int blYvsElUVshifts = elChromaSubsampling + quarterResolutionEl;
-	std::array<const uint16_t*, (1 << blYvsElUVshifts)> blSrcYp;
-	std::array<const uint16_t*, (1 << elChromaSubsampling)> elSrcYp;
-	std::array<uint16_t*, (1 << blYvsElUVshifts)> dstRp;
-	blSrcYp[0] = (const uint16_t*)blSrc->GetReadPtr(PLANAR_Y);
-	elSrcYp[0] = (const uint16_t*)elSrc->GetReadPtr(PLANAR_Y);
-	dstRp[0] = (uint16_t*)dst->GetWritePtr(PLANAR_R);
-
-	const int blUVvsElUVshifts = max(quarterResolutionEl + elChromaSubsampling - blChromaSubsampling, 0);
-	std::array<const uint16_t*, (1 << blUVvsElUVshifts)> blSrcUp;
-	std::array<const uint16_t*, 1> elSrcUp;
-	std::array<uint16_t*, (1 << blYvsElUVshifts)> dstGp;
-	blSrcUp[0] = (const uint16_t*)blSrc->GetReadPtr(PLANAR_U);
-	elSrcUp[0] = (const uint16_t*)elSrc->GetReadPtr(PLANAR_U);
-	dstGp[0] = (uint16_t*)dst->GetWritePtr(PLANAR_G);
-
-	std::array<const uint16_t*, (1 << blUVvsElUVshifts)> blSrcVp;
-	std::array<const uint16_t*, 1> elSrcVp;
-	std::array<uint16_t*, (1 << blYvsElUVshifts)> dstBp;
-	blSrcVp[0] = (const uint16_t*)blSrc->GetReadPtr(PLANAR_V);
-	elSrcVp[0] = (const uint16_t*)elSrc->GetReadPtr(PLANAR_V);
-	dstBp[0] = (uint16_t*)dst->GetWritePtr(PLANAR_B);
-
-	for (int i = 1; i < elSrcVp.size(); i++) {
-		elSrcUp[i] = elSrcUp[i - 1] + elSrcPitchUV;
-		elSrcVp[i] = elSrcVp[i - 1] + elSrcPitchUV;
-	}
-	for (int i = 1; i < elSrcYp.size(); i++) {
-		elSrcYp[i] = elSrcYp[i - 1] + elSrcPitchY;
-	}
-	for (int i = 1; i < blSrcVp.size(); i++) {
-		blSrcUp[i] = blSrcUp[i - 1] + blSrcPitchUV;
-		blSrcVp[i] = blSrcVp[i - 1] + blSrcPitchUV;
-	}
-	for (int i = 1; i < dstBp.size(); i++) {
-		blSrcYp[i] = blSrcYp[i - 1] + blSrcPitchY;
-		dstRp[i] = dstRp[i - 1] + dstPitch;
-		dstGp[i] = dstGp[i - 1] + dstPitch;
-		dstBp[i] = dstBp[i - 1] + dstPitch;
-	}
-
-	for (int heluv = 0; heluv < elSrcHeightUV; heluv++) {
-		for (int weluv = 0; weluv < elSrcWidthUV; weluv++) {
-
-			const uint16_t& elu = elSrcUp[0][weluv];
-			const uint16_t& elv = elSrcVp[0][weluv];
-
-			for (int hDbluv = 0; hDbluv < (1 << blUVvsElUVshifts); hDbluv++) {
-				for (int wDbluv = 0; wDbluv < (1 << blUVvsElUVshifts); wDbluv++) {
-
-					int wbluv = (weluv << blUVvsElUVshifts) + wDbluv;
-					const uint16_t& blu = blSrcUp[hDbluv][wbluv];
-					const uint16_t& blv = blSrcVp[hDbluv][wbluv];
-
-					int hDbluvy = hDbluv << blChromaSubsampling;
-					int wbluvy = wbluv << blChromaSubsampling;
-					const uint16_t& mmrbly = blSrcYp[hDbluvy][wbluvy];
-
-					const uint16_t& u = doviProc->processSampleU(blu, elu, mmrbly, blu, blv);
-					const uint16_t& v = doviProc->processSampleV(blv, elv, mmrbly, blu, blv);
-
-					for (int hDbly = 0; hDbly < blChromaSubsampling + 1; hDbly++) {
-						for (int wDbly = 0; wDbly < blChromaSubsampling + 1; wDbly++) {
-
-							int hDDbly = hDbluvy + hDbly;
-							int wbly = wbluvy + wDbly;
-							const uint16_t& bly = blSrcYp[hDDbly][wbly];
-
-							int hDely = hDDbly >> quarterResolutionEl;
-							int wely = wbly >> quarterResolutionEl;
-							const uint16_t& ely = elSrcYp[hDely][wely];
-
-							const uint16_t& y = doviProc->processSampleY(bly, ely);
-							doviProc->sample2rgb(dstRp[hDDbly][wbly], dstGp[hDDbly][wbly], dstBp[hDDbly][wbly], y, u, v);
-						}
-					}
-				}
+	const uint16_t* blSrcYp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_Y);
+	const uint16_t* blSrcUp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_U);
+	const uint16_t* blSrcVp = (const uint16_t*)blSrc->GetReadPtr(PLANAR_V);
+	const uint16_t* elSrcYp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_Y);
+	const uint16_t* elSrcUp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_U);
+	const uint16_t* elSrcVp = (const uint16_t*)elSrc->GetReadPtr(PLANAR_V);
+	uint16_t* dstRp = (uint16_t*)dst->GetWritePtr(PLANAR_R);
+	uint16_t* dstGp = (uint16_t*)dst->GetWritePtr(PLANAR_G);
+	uint16_t* dstBp = (uint16_t*)dst->GetWritePtr(PLANAR_B);
+
+	// shift from BL luma coordinates to the EL chroma plane
+	const int elUVShift = elQuarterResolution + elChromaSubsampling;
+	const int elUVStep = 1 << elUVShift;
+
+	ScratchArena::Scope scratch;
+	uint16_t* yRow = scratch.alloc<uint16_t>(width);
+	int* elRow = scratch.alloc<int>(elWidthY);
+	uint16_t* uCur = scratch.alloc<uint16_t>(widthUV * 4);
+	uint16_t* vCur = uCur + widthUV;
+	uint16_t* uNext = vCur + widthUV;
+	uint16_t* vNext = uNext + widthUV;
+	uint16_t* u444 = scratch.alloc<uint16_t>(widthUV << blChromaSubsampling);
+	uint16_t* v444 = scratch.alloc<uint16_t>(widthUV << blChromaSubsampling);
+	uint16_t* mmrRow = scratch.alloc<uint16_t>(widthUV);
+	uint16_t* mappedU = scratch.alloc<uint16_t>(widthUV);
+	uint16_t* mappedV = scratch.alloc<uint16_t>(widthUV);
+
+	// composes one row of chroma in the resolution of the BL chroma
+	auto composeChroma = [&](int huv, uint16_t* uDst, uint16_t* vDst) {
+		const int hy = huv << blChromaSubsampling;
+		const uint16_t* blY0 = blSrcYp + blSrcPitchY * hy;
+		if (blChromaSubsampling) {
+			downsampleLuma(mmrRow, widthUV, blSrc, huv, huv + 1, false);
+		}
+		const uint16_t* blU = blSrcUp + blSrcPitchUV * huv;
+		const uint16_t* blV = blSrcVp + blSrcPitchUV * huv;
+		const bool mapped = doviProc->mapChromaRow(mappedU, mappedV, blChromaSubsampling ? mmrRow : blY0, blU, blV, widthUV);
+
+		// the EL chroma is top left sited as well, it is weighted between its nearest samples
+		const int fy = hy & (elUVStep - 1);
+		const int he0 = hy >> elUVShift;
+		const int he1 = min(he0 + 1, elHeightUV - 1);
+		const uint16_t* elU0 = elSrcUp + elSrcPitchUV * he0;
+		const uint16_t* elU1 = elSrcUp + elSrcPitchUV * he1;
+		const uint16_t* elV0 = elSrcVp + elSrcPitchUV * he0;
+		const uint16_t* elV1 = elSrcVp + elSrcPitchUV * he1;
+
+		for (int wuv = 0; wuv < widthUV; wuv++) {
+			const int wy = wuv << blChromaSubsampling;
+			const int fx = wy & (elUVStep - 1);
+			const int we0 = wy >> elUVShift;
+			const int we1 = min(we0 + 1, elWidthUV - 1);
+			const int w00 = (elUVStep - fx) * (elUVStep - fy);
+			const int w01 = fx * (elUVStep - fy);
+			const int w10 = (elUVStep - fx) * fy;
+			const int w11 = fx * fy;
+			const int round = (elUVStep * elUVStep) >> 1;
+			const uint16_t elu = (w00 * elU0[we0] + w01 * elU0[we1] + w10 * elU1[we0] + w11 * elU1[we1] + round) >> (2 * elUVShift);
+			const uint16_t elv = (w00 * elV0[we0] + w01 * elV0[we1] + w10 * elV1[we0] + w11 * elV1[we1] + round) >> (2 * elUVShift);
+
+			if (mapped) {
+				uDst[wuv] = doviProc->processMappedSampleU(mappedU[wuv], elu);
+				vDst[wuv] = doviProc->processMappedSampleV(mappedV[wuv], elv);
+				continue;
+			}
+			const uint16_t mmrBlY = blChromaSubsampling ? mmrRow[wuv] : blY0[wy];
+			uDst[wuv] = doviProc->processSampleU(blU[wuv], elu, mmrBlY, blU[wuv], blV[wuv]);
+			vDst[wuv] = doviProc->processSampleV(blV[wuv], elv, mmrBlY, blU[wuv], blV[wuv]);
+		}
+	};
+
+	for (int h = 0; h < height; h++) {
+		const uint16_t* blY = blSrcYp + blSrcPitchY * h;
+		const uint16_t* uRow = uCur;
+		const uint16_t* vRow = vCur;
+
+		if (!blChromaSubsampling) {
+			composeChroma(h, uCur, vCur);
+		}
+		else {
+			if (h == 0) {
+				composeChroma(0, uCur, vCur);
+				composeChroma(min(1, heightUV - 1), uNext, vNext);
+			}
+			else if ((h & 1) == 0) {
+				std::swap(uCur, uNext);
+				std::swap(vCur, vNext);
+				composeChroma(min((h >> 1) + 1, heightUV - 1), uNext, vNext);
+			}
+			// the chroma is top left sited, odd rows and columns lie halfway between two chroma samples
+			const bool oddRow = h & 1;
+			for (int wuv = 0; wuv < widthUV; wuv++) {
+				const int wuv1 = min(wuv + 1, widthUV - 1);
+				const int u0 = oddRow ? (uCur[wuv] + uNext[wuv] + 1) >> 1 : uCur[wuv];
+				const int u1 = oddRow ? (uCur[wuv1] + uNext[wuv1] + 1) >> 1 : uCur[wuv1];
+				const int v0 = oddRow ? (vCur[wuv] + vNext[wuv] + 1) >> 1 : vCur[wuv];
+				const int v1 = oddRow ? (vCur[wuv1] + vNext[wuv1] + 1) >> 1 : vCur[wuv1];
+				u444[2 * wuv] = u0;
+				u444[2 * wuv + 1] = (u0 + u1 + 1) >> 1;
+				v444[2 * wuv] = v0;
+				v444[2 * wuv + 1] = (v0 + v1 + 1) >> 1;
 			}
+			uRow = u444;
+			vRow = v444;
 		}
 
-		for (int i = 0; i < elSrcVp.size(); i++) {
-			elSrcVp[i] += elSrcPitchUV;
-			elSrcUp[i] += elSrcPitchUV;
+		if (elQuarterResolution) {
+			// the EL luma is center sited, even samples lie a quarter sample before and odd ones a quarter sample after their EL sample
+			const int he0 = h >> 1;
+			const int he1 = (h & 1) ? min(he0 + 1, elHeightY - 1) : max(he0 - 1, 0);
+			const uint16_t* elY0 = elSrcYp + elSrcPitchY * he0;
+			const uint16_t* elY1 = elSrcYp + elSrcPitchY * he1;
+			for (int we = 0; we < elWidthY; we++) {
+				elRow[we] = 3 * elY0[we] + elY1[we];
+			}
+			for (int w = 0; w < width; w++) {
+				const int we0 = w >> 1;
+				const int we1 = (w & 1) ? min(we0 + 1, elWidthY - 1) : max(we0 - 1, 0);
+				const uint16_t ely = (3 * elRow[we0] + elRow[we1] + 8) >> 4;
+				yRow[w] = doviProc->processSampleY(blY[w], ely);
+			}
+		}
+		else {
+			const uint16_t* elY = elSrcYp + elSrcPitchY * h;
+			for (int w = 0; w < width; w++) {
+				yRow[w] = doviProc->processSampleY(blY[w], elY[w]);
+			}
 		}
-		for (int i = 0; i < elSrcYp.size(); i++) {
-			elSrcYp[i] += elSrcPitchY * elSrcYp.size();
+
+		uint16_t* dstR = dstRp + dstPitch * h;
+		uint16_t* dstG = dstGp + dstPitch * h;
+		uint16_t* dstB = dstBp + dstPitch * h;
+		doviProc->sample2rgbRow(dstR, dstG, dstB, yRow, uRow, vRow, width, 0);
+		if (finalStore) {
+			ditherRow(dstR, 0, width, h);
+			ditherRow(dstG, 0, width, h);
+			ditherRow(dstB, 0, width, h);
 		}
-		for (int i = 0; i < blSrcVp.size(); i++) {
-			blSrcVp[i] += blSrcPitchUV * blSrcVp.size();
-			blSrcUp[i] += blSrcPitchUV * blSrcVp.size();
+	}
+}
+
+template<int quarterResolutionEl>
+template<int bilinear>
+void DoViBaker<quarterResolutionEl>::doAllInline(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, bool skipElProcessing, bool finalStore, IScriptEnvironment* env) const {
+	if (skipElProcessing) {
+		if (blClipChromaSubSampled) {
+			if (bilinear) doAllBilinear<true, true, false>(dst, blSrc, elSrc, finalStore, env);
+			else doAllQuickAndDirty<true, true, false>(dst, blSrc, elSrc, finalStore, env);
 		}
-		for (int i = 0; i < blSrcYp.size(); i++) {
-			blSrcYp[i] += blSrcPitchY * blSrcYp.size();
-			dstRp[i] += dstPitch * blSrcYp.size();
-			dstGp[i] += dstPitch * blSrcYp.size();
-			dstBp[i] += dstPitch * blSrcYp.size();
+		else {
+			if (bilinear) doAllBilinear<false, false, false>(dst, blSrc, elSrc, finalStore, env);
+			else doAllQuickAndDirty<false, false, false>(dst, blSrc, elSrc, finalStore, env);
 		}
 	}
+	else if (blClipChromaSubSampled && elClipChromaSubSampled) {
+		if (bilinear) doAllBilinear<true, true, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+		else doAllQuickAndDirty<true, true, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+	}
+	else if (blClipChromaSubSampled && !elClipChromaSubSampled) {
+		if (bilinear) doAllBilinear<true, false, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+		else doAllQuickAndDirty<true, false, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+	}
+	else if (!blClipChromaSubSampled && elClipChromaSubSampled) {
+		if (bilinear) doAllBilinear<false, true, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+		else doAllQuickAndDirty<false, true, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+	}
+	else {
+		if (bilinear) doAllBilinear<false, false, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+		else doAllQuickAndDirty<false, false, quarterResolutionEl>(dst, blSrc, elSrc, finalStore, env);
+	}
 }
 
 template<int quarterResolutionEl>
-void DoViBaker<quarterResolutionEl>::convert2rgb(PVideoFrame& dst, const PVideoFrame& srcY, const PVideoFrame& srcUV) const
+uint16_t DoViBaker<quarterResolutionEl>::ditherSample(uint16_t sample, int x, int y) const
 {
+	const int shift = DoViProcessor::containerBitDepth - outputDepth;
+	const int maxValue = (1 << outputDepth) - 1;
+	const int v = (sample + ((bayer8x8[y & 7][x & 7] << shift) >> 6)) >> shift;
+	return v > maxValue ? maxValue : v;
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::ditherRow(uint16_t* row, int begin, int end, int y) const
+{
+	for (int x = begin; x < end; x++) {
+		row[x] = ditherSample(row[x], x, y);
+	}
+}
+
+template<int quarterResolutionEl>
+uint16_t DoViBaker<quarterResolutionEl>::reduceDepth(uint16_t sample) const
+{
+	// constant colors are rounded instead of dithered
+	const int shift = DoViProcessor::containerBitDepth - outputDepth;
+	const int maxValue = (1 << outputDepth) - 1;
+	const int v = (sample + ((1 << shift) >> 1)) >> shift;
+	return v > maxValue ? maxValue : v;
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::convert2rgb(PVideoFrame& dst, const PVideoFrame& srcY, const PVideoFrame& srcUV, const Area& area, bool finalStore) const
+{
+	finalStore = finalStore && outputDepth < DoViProcessor::containerBitDepth;
+
 	const int srcPitchY = srcY->GetPitch(PLANAR_Y) / sizeof(uint16_t);
 
 	const int dstPitch = dst->GetPitch(PLANAR_R) / sizeof(uint16_t);
@@ -494,8 +1215,6 @@ void DoViBaker<quarterResolutionEl>::convert2rgb(PVideoFrame& dst, const PVideoF
 	const uint16_t* srcYp = (const uint16_t*)srcY->GetReadPtr(PLANAR_Y);
 	uint16_t* dstRp = (uint16_t*)dst->GetWritePtr(PLANAR_R);
 
-	const int srcHeightUV = srcUV->GetHeight(PLANAR_U);
-	const int srcWidthUV = srcUV->GetRowSize(PLANAR_U) / sizeof(uint16_t);
 	const int srcPitchUV = srcUV->GetPitch(PLANAR_U) / sizeof(uint16_t);
 
 	const uint16_t* srcUp = (const uint16_t*)srcUV->GetReadPtr(PLANAR_U);
@@ -504,10 +1223,22 @@ void DoViBaker<quarterResolutionEl>::convert2rgb(PVideoFrame& dst, const PVideoF
 	const uint16_t* srcVp = (const uint16_t*)srcUV->GetReadPtr(PLANAR_V);
 	uint16_t* dstBp = (uint16_t*)dst->GetWritePtr(PLANAR_B);
 
-	for (int huv = 0; huv < srcHeightUV; huv++) {
-		for (int wuv = 0; wuv < srcWidthUV; wuv++) {
+	srcYp += srcPitchY * area.top;
+	srcUp += srcPitchUV * area.top;
+	srcVp += srcPitchUV * area.top;
+	dstRp += dstPitch * area.top;
+	dstGp += dstPitch * area.top;
+	dstBp += dstPitch * area.top;
+
+	for (int huv = area.top; huv < area.bottom; huv++) {
+		for (int wuv = area.left; wuv < area.right; wuv++) {
 			doviProc->sample2rgb(dstRp[wuv], dstGp[wuv], dstBp[wuv], srcYp[wuv], srcUp[wuv], srcVp[wuv]);
 		}
+		if (finalStore) {
+			ditherRow(dstRp, area.left, area.right, huv);
+			ditherRow(dstGp, area.left, area.right, huv);
+			ditherRow(dstBp, area.left, area.right, huv);
+		}
 
 		srcYp += srcPitchY;
 		srcUp += srcPitchUV;
@@ -520,12 +1251,11 @@ void DoViBaker<quarterResolutionEl>::convert2rgb(PVideoFrame& dst, const PVideoF
 }
 
 template<int quarterResolutionEl>
-void DoViBaker<quarterResolutionEl>::applyLut(PVideoFrame& dst, const PVideoFrame& src) const
+void DoViBaker<quarterResolutionEl>::applyLut(PVideoFrame& dst, const PVideoFrame& src, const Area& area) const
 {
-	unsigned int width = vi.width;
-	unsigned int height = vi.height;
+	unsigned int width = area.right - area.left;
+	unsigned int height = area.bottom - area.top;
 
-	std::unique_ptr<float, decltype(&_aligned_free)> tmp_buf{ nullptr, _aligned_free };
 	unsigned aligned_width = width % 8 ? (width - width % 8) + 8 : width;
 
 	const uint16_t* src_p[3];
@@ -546,25 +1276,40 @@ void DoViBaker<quarterResolutionEl>::applyLut(PVideoFrame& dst, const PVideoFram
 	dst_stride[0] = dst->GetPitch(PLANAR_R) / sizeof(uint16_t);
 	dst_stride[1] = dst->GetPitch(PLANAR_G) / sizeof(uint16_t);
 	dst_stride[2] = dst->GetPitch(PLANAR_B) / sizeof(uint16_t);
+	for (unsigned p = 0; p < 3; ++p)
+	{
+		src_p[p] += src_stride[p] * area.top + area.left;
+		dst_p[p] += dst_stride[p] * area.top + area.left;
+	}
 
-	tmp_buf.reset((float*)_aligned_malloc(aligned_width * 3 * sizeof(float), 32));
-	if (!tmp_buf)
-		throw std::bad_alloc{};
+	ScratchArena::Scope scratch;
+	float* tmp_buf = scratch.alloc<float>(aligned_width * 3);
 
-	tmp[0] = tmp_buf.get();
-	tmp[1] = tmp_buf.get() + aligned_width;
-	tmp[2] = tmp_buf.get() + aligned_width * 2;
+	tmp[0] = tmp_buf;
+	tmp[1] = tmp_buf + aligned_width;
+	tmp[2] = tmp_buf + aligned_width * 2;
 
 	timecube::PixelFormat format;
 	format.type = (timecube::PixelType)1;
 	format.depth = DoViProcessor::containerBitDepth;
 	format.fullrange = true;
+	timecube::PixelFormat outFormat = format;
+	outFormat.depth = outputDepth;
+	const bool dither = outputDepth < DoViProcessor::containerBitDepth;
+	const float ditherScale = 1.0f / 64 / ((1 << outputDepth) - 1);
 
 	for (unsigned i = 0; i < height; ++i)
 	{
 		current_frame_lut->to_float((const void**)src_p, tmp, format, width);
 		current_frame_lut->process(tmp, tmp, width);
-		current_frame_lut->from_float(tmp, (void**)dst_p, format, width);
+		if (dither) {
+			// the conversion rounds, so the dither is centered around zero
+			const uint8_t* bayerRow = bayer8x8[(area.top + i) & 7];
+			for (unsigned p = 0; p < 3; ++p)
+				for (unsigned x = 0; x < width; ++x)
+					tmp[p][x] += (bayerRow[(area.left + x) & 7] - 31.5f) * ditherScale;
+		}
+		current_frame_lut->from_float(tmp, (void**)dst_p, outFormat, width);
 
 		for (unsigned p = 0; p < 3; ++p)
 		{
@@ -574,11 +1319,193 @@ void DoViBaker<quarterResolutionEl>::applyLut(PVideoFrame& dst, const PVideoFram
 	}
 }
 
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::rgb2yuv(float* yuv, const float* rgb) const
+{
+	// BT.2020 non constant luminance, limited range in codes of the output depth
+	static const float kr = 0.2627f;
+	static const float kb = 0.0593f;
+	static const float kg = 1.0f - kr - kb;
+	const float scale = float(1 << (outputDepth - 8));
+	const float y = kr * rgb[0] + kg * rgb[1] + kb * rgb[2];
+	yuv[0] = (219.0f * y + 16.0f) * scale;
+	yuv[1] = (224.0f * (rgb[2] - y) / (2.0f * (1.0f - kb)) + 128.0f) * scale;
+	yuv[2] = (224.0f * (rgb[0] - y) / (2.0f * (1.0f - kr)) + 128.0f) * scale;
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::convert2yuv420(PVideoFrame& dst, const PVideoFrame& srcY, const PVideoFrame& srcUV, const Area& area, bool applyCube) const
+{
+	// two rows at a time are converted to RGB, mapped through the lut and converted to YUV420, the RGB frame is never stored
+	const int width = area.right - area.left;
+	const unsigned aligned_width = width % 8 ? (width - width % 8) + 8 : width;
+
+	ScratchArena::Scope scratch;
+	float* tmp_buf = scratch.alloc<float>(aligned_width * 10);
+	uint16_t* rgb_buf = scratch.alloc<uint16_t>(aligned_width * 6);
+
+	uint16_t* rgb16[2][3];
+	float* rgb[2][3];
+	float* cb[2];
+	float* cr[2];
+	for (int r = 0; r < 2; r++) {
+		for (int c = 0; c < 3; c++) {
+			rgb16[r][c] = rgb_buf + aligned_width * (3 * r + c);
+			rgb[r][c] = tmp_buf + aligned_width * (3 * r + c);
+		}
+		cb[r] = tmp_buf + aligned_width * (6 + r);
+		cr[r] = tmp_buf + aligned_width * (8 + r);
+	}
+
+	timecube::PixelFormat format;
+	format.type = (timecube::PixelType)1;
+	format.depth = DoViProcessor::containerBitDepth;
+	format.fullrange = true;
+
+	const int srcPitchY = srcY->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int srcPitchUV = srcUV->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	const uint16_t* srcYp = (const uint16_t*)srcY->GetReadPtr(PLANAR_Y) + srcPitchY * area.top + area.left;
+	const uint16_t* srcUp = (const uint16_t*)srcUV->GetReadPtr(PLANAR_U) + srcPitchUV * area.top + area.left;
+	const uint16_t* srcVp = (const uint16_t*)srcUV->GetReadPtr(PLANAR_V) + srcPitchUV * area.top + area.left;
+
+	const int dstPitchY = dst->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int dstPitchUV = dst->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	uint16_t* dstYp = (uint16_t*)dst->GetWritePtr(PLANAR_Y) + dstPitchY * area.top + area.left;
+	uint16_t* dstUp = (uint16_t*)dst->GetWritePtr(PLANAR_U) + dstPitchUV * (area.top >> 1) + (area.left >> 1);
+	uint16_t* dstVp = (uint16_t*)dst->GetWritePtr(PLANAR_V) + dstPitchUV * (area.top >> 1) + (area.left >> 1);
+
+	const int maxValue = (1 << outputDepth) - 1;
+	const bool dither = outputDepth < DoViProcessor::containerBitDepth;
+	auto store = [&](float v, int x, int y) -> uint16_t {
+		if (dither)
+			v += (bayer8x8[y & 7][x & 7] - 31.5f) / 64;
+		const int i = int(v + 0.5f);
+		return i < 0 ? 0 : (i > maxValue ? maxValue : i);
+	};
+
+	for (int h = area.top; h < area.bottom; h += 2) {
+		for (int r = 0; r < 2; r++) {
+			for (int x = 0; x < width; x++) {
+				doviProc->sample2rgb(rgb16[r][0][x], rgb16[r][1][x], rgb16[r][2][x], srcYp[x], srcUp[x], srcVp[x]);
+			}
+			if (applyCube) {
+				current_frame_lut->to_float((const void**)rgb16[r], rgb[r], format, width);
+				current_frame_lut->process(rgb[r], rgb[r], width);
+			}
+			else {
+				for (int c = 0; c < 3; c++)
+					for (int x = 0; x < width; x++)
+						rgb[r][c][x] = rgb16[r][c][x] * (1.0f / 65535);
+			}
+			for (int x = 0; x < width; x++) {
+				float pixel[3] = { rgb[r][0][x], rgb[r][1][x], rgb[r][2][x] };
+				float yuv[3];
+				rgb2yuv(yuv, pixel);
+				dstYp[x] = store(yuv[0], area.left + x, h + r);
+				cb[r][x] = yuv[1];
+				cr[r][x] = yuv[2];
+			}
+			srcYp += srcPitchY;
+			srcUp += srcPitchUV;
+			srcVp += srcPitchUV;
+			dstYp += dstPitchY;
+		}
+
+		// the chroma is sited left, horizontally cosited with the even luma samples and vertically between both rows
+		for (int xc = 0; xc < width / 2; xc++) {
+			const int x = 2 * xc;
+			const int xl = max(x - 1, 0);
+			const int xr = x + 1;
+			const float u = (cb[0][xl] + 2 * cb[0][x] + cb[0][xr] + cb[1][xl] + 2 * cb[1][x] + cb[1][xr]) * 0.125f;
+			const float v = (cr[0][xl] + 2 * cr[0][x] + cr[0][xr] + cr[1][xl] + 2 * cr[1][x] + cr[1][xr]) * 0.125f;
+			dstUp[xc] = store(u, (area.left >> 1) + xc, h >> 1);
+			dstVp[xc] = store(v, (area.left >> 1) + xc, h >> 1);
+		}
+		dstUp += dstPitchUV;
+		dstVp += dstPitchUV;
+	}
+}
+
+template<int quarterResolutionEl>
+bool DoViBaker<quarterResolutionEl>::findActiveArea()
+{
+	// the L5 offsets are given in samples of the full resolution frame
+	const int shift = downscale ? 1 : 0;
+	const int left = doviProc->getActiveAreaLeftOffset() >> shift;
+	const int right = doviProc->getActiveAreaRightOffset() >> shift;
+	const int top = doviProc->getActiveAreaTopOffset() >> shift;
+	const int bottom = doviProc->getActiveAreaBottomOffset() >> shift;
+	activeArea = { 0, 0, vi.width, vi.height };
+	composeArea = activeArea;
+	if (left + right == 0 && top + bottom == 0) {
+		return false;
+	}
+	if (left + right >= vi.width || top + bottom >= vi.height) {
+		return false; // implausible, better compose everything
+	}
+	activeArea = { left, top, vi.width - right, vi.height - bottom };
+
+	// the chroma upsampling of the composed frame reads a few samples beyond the active area
+	static const int margin = 8;
+	composeArea.left = max(left - margin, 0) & ~1;
+	composeArea.top = max(top - margin, 0) & ~1;
+	composeArea.right = min((activeArea.right + margin + 1) & ~1, vi.width);
+	composeArea.bottom = min((activeArea.bottom + margin + 1) & ~1, vi.height);
+	return true;
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::composeBarColor(uint16_t* yuv, const PVideoFrame& blSrc, int x, int y) const
+{
+	// the bars are uniform, so a single BL sample of them is composed without residual
+	const int shift = blClipChromaSubSampled ? 1 : 0;
+	const uint16_t bly = ((const uint16_t*)(blSrc->GetReadPtr(PLANAR_Y) + y * blSrc->GetPitch(PLANAR_Y)))[x];
+	const uint16_t blu = ((const uint16_t*)(blSrc->GetReadPtr(PLANAR_U) + (y >> shift) * blSrc->GetPitch(PLANAR_U)))[x >> shift];
+	const uint16_t blv = ((const uint16_t*)(blSrc->GetReadPtr(PLANAR_V) + (y >> shift) * blSrc->GetPitch(PLANAR_V)))[x >> shift];
+	yuv[0] = doviProc->processSampleY(bly, doviProc->getNlqOffset(0));
+	yuv[1] = doviProc->processSampleU(blu, doviProc->getNlqOffset(1), bly, blu, blv);
+	yuv[2] = doviProc->processSampleV(blv, doviProc->getNlqOffset(2), bly, blu, blv);
+}
+
+template<int quarterResolutionEl>
+template<typename T>
+void DoViBaker<quarterResolutionEl>::fillBars(PVideoFrame& dst, const int* planes, const T* color, int chromaShift) const
+{
+	for (int i = 0; i < 3; i++) {
+		const int shift = i ? chromaShift : 0;
+		const int width = dst->GetRowSize(planes[i]) / sizeof(T);
+		const int height = dst->GetHeight(planes[i]);
+		const int pitch = dst->GetPitch(planes[i]) / sizeof(T);
+		T* dstP = (T*)dst->GetWritePtr(planes[i]);
+
+		// chroma samples touching the active area are kept
+		const int left = activeArea.left >> shift;
+		const int top = activeArea.top >> shift;
+		const int right = (activeArea.right + (1 << shift) - 1) >> shift;
+		const int bottom = (activeArea.bottom + (1 << shift) - 1) >> shift;
+
+		for (int h = 0; h < height; h++) {
+			if (h < top || h >= bottom) {
+				std::fill_n(dstP, width, color[i]);
+			}
+			else {
+				std::fill_n(dstP, left, color[i]);
+				std::fill(dstP + right, dstP + width, color[i]);
+			}
+			dstP += pitch;
+		}
+	}
+}
+
 template<int quarterResolutionEl>
 PVideoFrame DoViBaker<quarterResolutionEl>::GetFrame(int n, IScriptEnvironment* env)
 {
-	PVideoFrame blSrc = child->GetFrame(n, env);
-	PVideoFrame elSrc = elChild ? elChild->GetFrame(n, env) : blSrc;
+	PVideoFrame blSrc = blPrefetcher ? blPrefetcher->GetFrame(n, env) : child->GetFrame(n, env);
+	if (downscale) {
+		PVideoFrame blHalf = env->NewVideoFrameP(containerVi, &blSrc);
+		downscaleBl(blHalf, blSrc);
+		blSrc = blHalf;
+	}
 	PVideoFrame dst;
 	if (!outYUV) {
 		dst = env->NewVideoFrameP(vi, &blSrc);
@@ -589,7 +1516,14 @@ PVideoFrame DoViBaker<quarterResolutionEl>::GetFrame(int n, IScriptEnvironment*
 		return dst;
 	}
 	
-	if (!outYUV) {
+	if (outYUV420) {
+		env->propSetInt(env->getFramePropsRW(dst), "_Matrix", 9, 0);         //output is BT.2020 ncl
+		env->propSetInt(env->getFramePropsRW(dst), "_ColorRange", 1, 0);     //output is limited range
+		env->propSetInt(env->getFramePropsRW(dst), "_ChromaLocation", 0, 0); //chroma is sited left
+		env->propSetInt(env->getFramePropsRW(dst), "_dovi_max_pq", doviProc->getMaxPq(), 0);
+		env->propSetInt(env->getFramePropsRW(dst), "_dovi_max_content_light_level", doviProc->getMaxContentLightLevel(), 0);
+	}
+	else if (!outYUV) {
 		env->propSetInt(env->getFramePropsRW(dst), "_Matrix", 0, 0);      //output is RGB
 		env->propSetInt(env->getFramePropsRW(dst), "_ColorRange", 0, 0);  //output is full range RGB
 		env->propDeleteKey(env->getFramePropsRW(dst), "_ChromaLocation"); //RGB has no chroma location defined
@@ -597,15 +1531,27 @@ PVideoFrame DoViBaker<quarterResolutionEl>::GetFrame(int n, IScriptEnvironment*
 		env->propSetInt(env->getFramePropsRW(dst), "_dovi_max_content_light_level", doviProc->getMaxContentLightLevel(), 0);
 	}
 
+	// letterbox bars signalled by L5 are not composed but filled with a single color
+	const bool hasBars = findActiveArea();
+	const bool barTopLeft = activeArea.left > 0 || activeArea.top > 0;
+	const int barX = barTopLeft ? 0 : vi.width - 1;
+	const int barY = barTopLeft ? 0 : vi.height - 1;
+
 	bool skipLut = luts.size() == 0;
 	if (!skipLut) {
-		current_frame_lut = luts[luts.size() - 1].second.get();
+		int lutIdx = luts.size() - 1;
 		for (int i = 1; i < luts.size(); i++) {
 			if (doviProc->getMaxContentLightLevel() <= luts[i].first) {
-				current_frame_lut = luts[i - 1].second.get();
+				lutIdx = i - 1;
 				break;
 			}
 		}
+		current_frame_lut = luts[lutIdx].second.get();
+		// the whole frame stays below the identity part of the cube, a max_pq of 0 means there was no L1 data
+		const uint16_t maxPq = doviProc->getMaxPq();
+		if (maxPq > 0 && maxPq <= lutIdentityKnees[lutIdx]) {
+			skipLut = true;
+		}
 	}
 
 	bool skipElProcessing = false;
@@ -618,15 +1564,63 @@ PVideoFrame DoViBaker<quarterResolutionEl>::GetFrame(int n, IScriptEnvironment*
 		return dst;
 	}
 
-	if (qnd) {
-		if (blClipChromaSubSampled && elClipChromaSubSampled)
-			doAllQuickAndDirty<true,true>(dst, blSrc, elSrc, env);
-		else if (blClipChromaSubSampled && !elClipChromaSubSampled)
-			doAllQuickAndDirty<true,false>(dst, blSrc, elSrc, env);
-		else if (!blClipChromaSubSampled && elClipChromaSubSampled)
-			doAllQuickAndDirty<false,true>(dst, blSrc, elSrc, env);
-		else if (!blClipChromaSubSampled && !elClipChromaSubSampled)
-			doAllQuickAndDirty<false,false>(dst, blSrc, elSrc, env);
+	// the EL is only decoded if the residual is actually applied, otherwise the BL stands in for it
+	PVideoFrame elSrc = blSrc;
+	if (!skipElProcessing) {
+		elSrc = elPrefetcher ? elPrefetcher->GetFrame(n, env) : elChild->GetFrame(n, env);
+		// most samples of a FEL carry no residual, a frame without any is processed like a MEL frame
+		if (findFlatElTiles(elSrc) == 0) {
+			skipElProcessing = true;
+			doviProc->forceDisableElProcessing();
+			elSrc = blSrc;
+		}
+	}
+
+	// identity mapping without residual: the composition only moves the BL samples to the container depth, the BL is used directly.
+	// a composed yuv output in the depth of the BL dithers back to exactly the BL samples
+	const bool passthrough = quality == 2 && skipElProcessing && doviProc->isIdentityMapping()
+		&& (outYUV ? outputDepth == blInputBitDepth : doviProc->isStandardMatrix());
+
+	if (passthrough) {
+		if (outYUV) {
+			// hand out the BL frame itself, only its properties need to be writable
+			if (has_at_least_v9)
+				env->MakePropertyWritable(&blSrc);
+			else
+				env->MakeWritable(&blSrc);
+			env->propSetInt(env->getFramePropsRW(blSrc), "_dovi_max_pq", doviProc->getMaxPq(), 0);
+			env->propSetInt(env->getFramePropsRW(blSrc), "_dovi_max_content_light_level", doviProc->getMaxContentLightLevel(), 0);
+			return blSrc;
+		}
+		PVideoFrame blWide = blSrc;
+		if (blInputBitDepth != DoViProcessor::containerBitDepth) {
+			blWide = env->NewVideoFrame(containerVi);
+			widenBl(blWide, blSrc);
+		}
+		PVideoFrame blSrc444;
+		if (blClipChromaSubSampled) {
+			VideoInfo vi444 = containerVi;
+			vi444.pixel_type = VideoInfo::CS_YUV444P16;
+			blSrc444 = env->NewVideoFrame(vi444);
+			upsampleChroma(blSrc444, blWide, vi444, env);
+		}
+		if (outYUV420)
+			return finishYUV420(dst, blWide, (!blSrc444) ? blWide : blSrc444, blSrc, !skipLut, hasBars, barX, barY);
+		if (outputDepth == 32)
+			return finishFloat(dst, blWide, (!blSrc444) ? blWide : blSrc444, blSrc, !skipLut, hasBars, barX, barY);
+		convert2rgb(dst, blWide, (!blSrc444) ? blWide : blSrc444, activeArea, skipLut);
+	}
+	else if (quality == 0) {
+		doAllInline<false>(dst, blSrc, elSrc, skipElProcessing, skipLut, env);
+	}
+	else if (quality == 1) {
+		doAllInline<true>(dst, blSrc, elSrc, skipElProcessing, skipLut, env);
+	}
+	else if (outYUV && quarterResolutionEl && blClipChromaSubSampled && !skipElProcessing) {
+		// the EL is upsampled while composing, the output frame is the only one written
+		dst = env->NewVideoFrameP(vi, &blSrc);
+		composeYUV420(dst, blSrc, elSrc, composeArea);
+		return finishYUV(dst, blSrc, hasBars, barX, barY, true, env);
 	}
 	else {
 		PVideoFrame blSrc444;
@@ -637,30 +1631,30 @@ PVideoFrame DoViBaker<quarterResolutionEl>::GetFrame(int n, IScriptEnvironment*
 			if (quarterResolutionEl) {
 				PVideoFrame elUpSrc;
 				if (!blClipChromaSubSampled && elClipChromaSubSampled) {
-					VideoInfo vi420 = child->GetVideoInfo();
+					VideoInfo vi420 = containerVi;
 					vi420.pixel_type = VideoInfo::CS_YUV420P16;
 					elUpSrc = env->NewVideoFrame(vi420);
 					upscaleEl(elUpSrc, elSrc, vi420, env);
 				}
 				else if (blClipChromaSubSampled && !elClipChromaSubSampled) {
-					VideoInfo vi444 = child->GetVideoInfo();
+					VideoInfo vi444 = containerVi;
 					vi444.pixel_type = VideoInfo::CS_YUV444P16;
 					elUpSrc = env->NewVideoFrame(vi444);
 					upscaleEl(elUpSrc, elSrc, vi444, env);
 				}
 				else {
-					elUpSrc = env->NewVideoFrame(child->GetVideoInfo());
-					upscaleEl(elUpSrc, elSrc, child->GetVideoInfo(), env);
+					elUpSrc = env->NewVideoFrame(containerVi);
+					upscaleEl(elUpSrc, elSrc, containerVi, env);
 				}
 				elSrc = elUpSrc;
 			}
 			if (!blClipChromaSubSampled && elClipChromaSubSampled) {
-				elSrc444 = env->NewVideoFrame(child->GetVideoInfo());
-				upsampleChroma(elSrc444, elSrc, child->GetVideoInfo(), env);
+				elSrc444 = env->NewVideoFrame(containerVi);
+				upsampleChroma(elSrc444, elSrc, containerVi, env);
 				frameChromaSubSampled = false;
 			}
 			if (blClipChromaSubSampled && !elClipChromaSubSampled) {
-				VideoInfo vi444 = child->GetVideoInfo();
+				VideoInfo vi444 = containerVi;
 				vi444.pixel_type = VideoInfo::CS_YUV444P16;
 				blSrc444 = env->NewVideoFrame(vi444);
 				upsampleChroma(blSrc444, blSrc, vi444, env);
@@ -670,38 +1664,189 @@ PVideoFrame DoViBaker<quarterResolutionEl>::GetFrame(int n, IScriptEnvironment*
 		else { elSrcR = blSrc; }
 
 		PVideoFrame mez = [&]() {
-			if (blClipChromaSubSampled && !elClipChromaSubSampled) {
-				VideoInfo vi444 = child->GetVideoInfo();
+			if (blClipChromaSubSampled && !frameChromaSubSampled) {
+				VideoInfo vi444 = containerVi;
 				vi444.pixel_type = VideoInfo::CS_YUV444P16;
 				return env->NewVideoFrame(vi444);
 			}
+			else if (outYUV) {
+				// the YUV output is the composed frame itself, which is stored in the output depth
+				return env->NewVideoFrameP(vi, &blSrc);
+			}
 			else {
-				return env->NewVideoFrame(child->GetVideoInfo());
+				return env->NewVideoFrame(containerVi);
 			}
 		}();
 		if (frameChromaSubSampled)
-			applyDovi<true>(mez, blSrc, (!blSrc444) ? blSrc : blSrc444, elSrcR, (!elSrc444) ? elSrcR : elSrc444, env);
+			applyDovi<true>(mez, blSrc, (!blSrc444) ? blSrc : blSrc444, elSrcR, (!elSrc444) ? elSrcR : elSrc444, composeArea, outYUV, env);
 		else
-			applyDovi<false>(mez, blSrc, (!blSrc444) ? blSrc : blSrc444, elSrcR, (!elSrc444) ? elSrcR : elSrc444, env);
+			applyDovi<false>(mez, blSrc, (!blSrc444) ? blSrc : blSrc444, elSrcR, (!elSrc444) ? elSrcR : elSrc444, composeArea, outYUV, env);
 
 		if (outYUV) {
-			env->copyFrameProps(blSrc, mez);
-			env->propSetInt(env->getFramePropsRW(mez), "_dovi_max_pq", doviProc->getMaxPq(), 0);
-			env->propSetInt(env->getFramePropsRW(mez), "_dovi_max_content_light_level", doviProc->getMaxContentLightLevel(), 0);
-			return mez;
+			return finishYUV(mez, blSrc, hasBars, barX, barY, frameChromaSubSampled, env);
 		}
 
 		PVideoFrame mez444;
 		if (frameChromaSubSampled) {
-			VideoInfo vi444 = child->GetVideoInfo();
+			VideoInfo vi444 = containerVi;
 			vi444.pixel_type = VideoInfo::CS_YUV444P16;
 			mez444 = env->NewVideoFrame(vi444);
 			upsampleChroma(mez444, mez, vi444, env);
 		}
-		convert2rgb(dst, mez, (!mez444)? mez : mez444);
+		if (outYUV420)
+			return finishYUV420(dst, mez, (!mez444) ? mez : mez444, blSrc, !skipLut, hasBars, barX, barY);
+		if (outputDepth == 32)
+			return finishFloat(dst, mez, (!mez444) ? mez : mez444, blSrc, !skipLut, hasBars, barX, barY);
+		convert2rgb(dst, mez, (!mez444)? mez : mez444, activeArea, skipLut);
+	}
+	if (hasBars) {
+		static const int planes[] = { PLANAR_R, PLANAR_G, PLANAR_B };
+		uint16_t yuv[3];
+		uint16_t rgb[3];
+		composeBarColor(yuv, blSrc, barX, barY);
+		doviProc->sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
+		if (!skipLut) {
+			// map the color through the lut with a single sample of the bars
+			uint16_t* sample[3];
+			for (int i = 0; i < 3; i++) {
+				sample[i] = (uint16_t*)(dst->GetWritePtr(planes[i]) + barY * dst->GetPitch(planes[i])) + barX;
+				*sample[i] = rgb[i];
+			}
+			applyLut(dst, dst, { barX, barY, barX + 1, barY + 1 });
+			for (int i = 0; i < 3; i++) {
+				rgb[i] = *sample[i];
+			}
+		}
+		else {
+			for (int i = 0; i < 3; i++) {
+				rgb[i] = reduceDepth(rgb[i]);
+			}
+		}
+		fillBars(dst, planes, rgb, 0);
 	}
 	if (!skipLut) {
-		applyLut(dst, dst);
+		applyLut(dst, dst, activeArea);
+	}
+	return dst;
+}
+
+template<int quarterResolutionEl>
+PVideoFrame DoViBaker<quarterResolutionEl>::finishYUV(PVideoFrame& dst, const PVideoFrame& blSrc, bool hasBars, int barX, int barY, bool chromaSubSampled, IScriptEnvironment* env) const
+{
+	// the composed frame already carries the properties of the BL
+	if (hasBars) {
+		static const int planes[] = { PLANAR_Y, PLANAR_U, PLANAR_V };
+		uint16_t yuv[3];
+		composeBarColor(yuv, blSrc, barX, barY);
+		for (int i = 0; i < 3; i++) {
+			yuv[i] = reduceDepth(yuv[i]);
+		}
+		fillBars(dst, planes, yuv, chromaSubSampled ? 1 : 0);
+	}
+	env->propSetInt(env->getFramePropsRW(dst), "_dovi_max_pq", doviProc->getMaxPq(), 0);
+	env->propSetInt(env->getFramePropsRW(dst), "_dovi_max_content_light_level", doviProc->getMaxContentLightLevel(), 0);
+	return dst;
+}
+
+template<int quarterResolutionEl>
+PVideoFrame DoViBaker<quarterResolutionEl>::finishYUV420(PVideoFrame& dst, const PVideoFrame& srcY, const PVideoFrame& srcUV, const PVideoFrame& blSrc, bool applyCube, bool hasBars, int barX, int barY) const
+{
+	// the chroma needs whole sample pairs, the bars overwrite the additional samples again
+	const Area area = { activeArea.left & ~1, activeArea.top & ~1, (activeArea.right + 1) & ~1, (activeArea.bottom + 1) & ~1 };
+	convert2yuv420(dst, srcY, srcUV, area, applyCube);
+	if (hasBars) {
+		static const int planes[] = { PLANAR_Y, PLANAR_U, PLANAR_V };
+		uint16_t bar[3];
+		composeBarColor(bar, blSrc, barX, barY);
+		uint16_t rgb16[3];
+		doviProc->sample2rgb(rgb16[0], rgb16[1], rgb16[2], bar[0], bar[1], bar[2]);
+		alignas(32) float rgb[3][8] = {};
+		if (applyCube) {
+			const uint16_t* src[3] = { &rgb16[0], &rgb16[1], &rgb16[2] };
+			float* tmp[3] = { rgb[0], rgb[1], rgb[2] };
+			timecube::PixelFormat format;
+			format.type = (timecube::PixelType)1;
+			format.depth = DoViProcessor::containerBitDepth;
+			format.fullrange = true;
+			current_frame_lut->to_float((const void**)src, tmp, format, 1);
+			current_frame_lut->process(tmp, tmp, 1);
+		}
+		else {
+			for (int c = 0; c < 3; c++)
+				rgb[c][0] = rgb16[c] * (1.0f / 65535);
+		}
+		const float pixel[3] = { rgb[0][0], rgb[1][0], rgb[2][0] };
+		float yuv[3];
+		rgb2yuv(yuv, pixel);
+		uint16_t color[3];
+		for (int c = 0; c < 3; c++) {
+			color[c] = uint16_t(min(max(int(yuv[c] + 0.5f), 0), (1 << outputDepth) - 1));
+		}
+		fillBars(dst, planes, color, 1);
+	}
+	return dst;
+}
+
+template<int quarterResolutionEl>
+void DoViBaker<quarterResolutionEl>::convert2rgbFloat(PVideoFrame& dst, const PVideoFrame& srcY, const PVideoFrame& srcUV, const Area& area, bool applyCube) const
+{
+	// the normalized samples go straight into the lut buffers and are stored as float, they are never quantized to 16bit
+	const int width = area.right - area.left;
+	const unsigned aligned_width = width % 8 ? (width - width % 8) + 8 : width;
+
+	ScratchArena::Scope scratch;
+	float* tmp_buf = scratch.alloc<float>(aligned_width * 3);
+	// the lut processes whole vectors, the padding must hold valid values
+	std::fill_n(tmp_buf, aligned_width * 3, 0.0f);
+	float* rgb[3] = { tmp_buf, tmp_buf + aligned_width, tmp_buf + aligned_width * 2 };
+
+	const int srcPitchY = srcY->GetPitch(PLANAR_Y) / sizeof(uint16_t);
+	const int srcPitchUV = srcUV->GetPitch(PLANAR_U) / sizeof(uint16_t);
+	const uint16_t* srcYp = (const uint16_t*)srcY->GetReadPtr(PLANAR_Y) + srcPitchY * area.top + area.left;
+	const uint16_t* srcUp = (const uint16_t*)srcUV->GetReadPtr(PLANAR_U) + srcPitchUV * area.top + area.left;
+	const uint16_t* srcVp = (const uint16_t*)srcUV->GetReadPtr(PLANAR_V) + srcPitchUV * area.top + area.left;
+
+	const int dstPitch = dst->GetPitch(PLANAR_R) / sizeof(float);
+	float* dstRp = (float*)dst->GetWritePtr(PLANAR_R) + dstPitch * area.top + area.left;
+	float* dstGp = (float*)dst->GetWritePtr(PLANAR_G) + dstPitch * area.top + area.left;
+	float* dstBp = (float*)dst->GetWritePtr(PLANAR_B) + dstPitch * area.top + area.left;
+
+	for (int h = area.top; h < area.bottom; h++) {
+		for (int x = 0; x < width; x++) {
+			doviProc->sample2rgbFloat(rgb[0][x], rgb[1][x], rgb[2][x], srcYp[x], srcUp[x], srcVp[x]);
+		}
+		if (applyCube) {
+			current_frame_lut->process(rgb, rgb, width);
+		}
+		std::copy_n(rgb[0], width, dstRp);
+		std::copy_n(rgb[1], width, dstGp);
+		std::copy_n(rgb[2], width, dstBp);
+
+		srcYp += srcPitchY;
+		srcUp += srcPitchUV;
+		srcVp += srcPitchUV;
+		dstRp += dstPitch;
+		dstGp += dstPitch;
+		dstBp += dstPitch;
+	}
+}
+
+template<int quarterResolutionEl>
+PVideoFrame DoViBaker<quarterResolutionEl>::finishFloat(PVideoFrame& dst, const PVideoFrame& srcY, const PVideoFrame& srcUV, const PVideoFrame& blSrc, bool applyCube, bool hasBars, int barX, int barY) const
+{
+	convert2rgbFloat(dst, srcY, srcUV, activeArea, applyCube);
+	if (hasBars) {
+		static const int planes[] = { PLANAR_R, PLANAR_G, PLANAR_B };
+		uint16_t bar[3];
+		composeBarColor(bar, blSrc, barX, barY);
+		alignas(32) float rgb[3][8] = {};
+		doviProc->sample2rgbFloat(rgb[0][0], rgb[1][0], rgb[2][0], bar[0], bar[1], bar[2]);
+		if (applyCube) {
+			float* tmp[3] = { rgb[0], rgb[1], rgb[2] };
+			current_frame_lut->process(tmp, tmp, 1);
+		}
+		const float color[3] = { rgb[0][0], rgb[1][0], rgb[2][0] };
+		fillBars(dst, planes, color, 0);
 	}
 	return dst;
 }
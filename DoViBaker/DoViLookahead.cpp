@@ -0,0 +1,82 @@
+#include "DoViLookahead.h"
+
+#include <algorithm>
+
+DoViLookahead::DoViLookahead(int _numFrames, int _depth, prepare_t _prepare)
+	: numFrames(_numFrames), depth(_depth), prepare(_prepare), current(0), inFlight(-1), stop(false)
+{
+	thread = std::thread(&DoViLookahead::worker, this);
+}
+
+DoViLookahead::~DoViLookahead()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+		queue.clear();
+	}
+	workAvailable.notify_all();
+	thread.join();
+}
+
+bool DoViLookahead::take(int n, DoViFrameParams& params, DoViFrameInfo& info)
+{
+	bool found = false;
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		current = n;
+
+		for (auto it = ready.begin(); it != ready.end();) {
+			if (inWindow(it->first, n))
+				++it;
+			else
+				it = ready.erase(it);
+		}
+		queue.erase(std::remove_if(queue.begin(), queue.end(), [&](int k) { return !inWindow(k, n); }), queue.end());
+
+		if (inFlight == n) {
+			workDone.wait(lock, [&]() { return inFlight != n; });
+		}
+		auto it = ready.find(n);
+		if (it != ready.end()) {
+			params = it->second->params;
+			info = it->second->info;
+			ready.erase(it);
+			found = true;
+		}
+
+		for (int k = n + 1; k <= n + depth && k < numFrames; k++) {
+			if (k == inFlight || ready.count(k) || std::find(queue.begin(), queue.end(), k) != queue.end())
+				continue;
+			queue.push_back(k);
+		}
+	}
+	workAvailable.notify_one();
+	return found;
+}
+
+void DoViLookahead::worker()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true) {
+		workAvailable.wait(lock, [&]() { return stop || !queue.empty(); });
+		if (stop)
+			break;
+
+		int k = queue.front();
+		queue.pop_front();
+		inFlight = k;
+		lock.unlock();
+
+		// failures are not reported here, the frame is decoded again synchronously which then reports the error
+		auto frame = std::make_unique<PreparedFrame>();
+		bool success = prepare(k, frame->params, frame->info);
+
+		lock.lock();
+		inFlight = -1;
+		if (success && inWindow(k, current)) {
+			ready[k] = std::move(frame);
+		}
+		workDone.notify_all();
+	}
+}
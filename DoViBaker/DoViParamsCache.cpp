@@ -0,0 +1,56 @@
+#include "DoViParamsCache.h"
+
+DoViParamsCache::DoViParamsCache(size_t _maxEntries)
+	: maxEntries(_maxEntries)
+{
+}
+
+std::shared_ptr<DoViDerivedTables> DoViParamsCache::find(const DoViFrameParams& params, uint64_t hash, int frame)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	auto range = index.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second->tables->params == params) {
+			lru.splice(lru.begin(), lru, it->second);
+			Entry& entry = lru.front();
+			if (frame > entry.lastFrame)
+				entry.lastFrame = frame;
+			return entry.tables;
+		}
+	}
+	return nullptr;
+}
+
+void DoViParamsCache::insert(uint64_t hash, std::shared_ptr<DoViDerivedTables> tables, int frame)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	lru.push_front({ hash, frame, tables });
+	index.emplace(hash, lru.begin());
+	while (lru.size() > maxEntries) {
+		erase(std::prev(lru.end()));
+	}
+}
+
+void DoViParamsCache::newScene(int frame)
+{
+	// blocks of previous scenes are rarely seen again, blocks already prepared for the following frames are kept
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto it = lru.begin(); it != lru.end();) {
+		auto next = std::next(it);
+		if (it->lastFrame < frame)
+			erase(it);
+		it = next;
+	}
+}
+
+void DoViParamsCache::erase(lru_t::iterator entry)
+{
+	auto range = index.equal_range(entry->hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == entry) {
+			index.erase(it);
+			break;
+		}
+	}
+	lru.erase(entry);
+}
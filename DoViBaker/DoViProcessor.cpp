@@ -1,11 +1,25 @@
 #include "DoViProcessor.h"
+#include "ScratchArena.h"
+#include "cube.h"
 #include <array>
 #include <algorithm>
+#include <climits>
+#include <immintrin.h>
 #include <string>
 
-DoViProcessor::DoViProcessor(const char* rpuPath, IScriptEnvironment* env)
-	: successfulCreation(false), rgbProof(false), nlqProof(false), max_content_light_level(1000)
+DoViProcessor::DoViProcessor(const char* rpuPath, IScriptEnvironment* env, bool nativeDecoder)
+	: doviLib(NULL), successfulCreation(false), rgbProof(false), nlqProof(false), approxMmr(false), chromaTable(false), blInputBitDepth(containerBitDepth), elInputBitDepth(containerBitDepth), currentParams(&decoded)
+	, disable_residual_flag(false), scene_refresh_flag(false), identity_mapping(false), standard_matrix(false), max_pq(0), max_content_light_level(1000)
+	, active_area_left_offset(0), active_area_right_offset(0), active_area_top_offset(0), active_area_bottom_offset(0)
 {
+	// the analyzer has no script environment, it runs the plain code
+	const int cpuFlags = env ? env->GetCPUFlags() : 0;
+	sse41 = (cpuFlags & CPUF_SSE4_1) != 0;
+	fma3 = (cpuFlags & CPUF_AVX2) && (cpuFlags & CPUF_FMA3);
+	memset(&decoded, 0, sizeof(decoded));
+	memset(&currentInfo, 0, sizeof(currentInfo));
+	memset(&params, 0, sizeof(params));
+
 	ycc_to_rgb_coef[0] = 8192;
 	ycc_to_rgb_coef[1] = 0;
 	ycc_to_rgb_coef[2] = 12900;
@@ -20,18 +34,41 @@ DoViProcessor::DoViProcessor(const char* rpuPath, IScriptEnvironment* env)
 	ycc_to_rgb_offset[1] = (1 << (containerBitDepth - 1)) << ycc_to_rgb_offset_scale_shifts;
 	ycc_to_rgb_offset[2] = (1 << (containerBitDepth - 1)) << ycc_to_rgb_offset_scale_shifts;
 
+	if (DoViSidecar::isSidecar(rpuPath)) {
+		// precompiled by DoViAnalyzer, no need for libdovi
+		sidecar = std::make_unique<DoViSidecar>(rpuPath);
+		if (!sidecar->isValid()) {
+			showMessage((std::string("DoViBaker: ") + sidecar->getError()).c_str(), env);
+			return;
+		}
+		successfulCreation = true;
+		return;
+	}
+
+	if (nativeDecoder) {
+		rpuDecoder = std::make_unique<DoViRpuDecoder>();
+		reader = std::make_unique<DoViRpuReader>(rpuPath, nullptr, nullptr);
+		if (!reader->isValid()) {
+			showMessage((std::string("DoViBaker: ") + reader->getError()).c_str(), env);
+			return;
+		}
+		successfulCreation = true;
+		return;
+	}
+
 	doviLib = ::LoadLibrary(L"dovi.dll"); // delayed loading, original name
 	if (doviLib == NULL) {
 		showMessage("DoViBaker: Cannot load dovi.dll", env);
 		return;
 	}
 
-	dovi_parse_rpu_bin_file = (f_dovi_parse_rpu_bin_file)GetProcAddress(doviLib, "dovi_parse_rpu_bin_file");
-	if (dovi_parse_rpu_bin_file == NULL) {
-		showMessage("DoViBaker: Cannot load function dovi_parse_rpu_bin_file", env);
+	dovi_parse_unspec62_nalu = (f_dovi_parse_unspec62_nalu)GetProcAddress(doviLib, "dovi_parse_unspec62_nalu");
+	if (dovi_parse_unspec62_nalu == NULL) {
+		showMessage("DoViBaker: Cannot load function dovi_parse_unspec62_nalu", env);
 		return;
 	}
-	dovi_rpu_list_free = (f_dovi_rpu_list_free)GetProcAddress(doviLib, "dovi_rpu_list_free");
+	dovi_rpu_free = (f_dovi_rpu_free)GetProcAddress(doviLib, "dovi_rpu_free");
+	dovi_rpu_get_error = (f_dovi_rpu_get_error)GetProcAddress(doviLib, "dovi_rpu_get_error");
 	dovi_rpu_get_header = (f_dovi_rpu_get_header)GetProcAddress(doviLib, "dovi_rpu_get_header");
 	dovi_rpu_free_header = (f_dovi_rpu_free_header)GetProcAddress(doviLib, "dovi_rpu_free_header");
 	dovi_rpu_get_data_nlq = (f_dovi_rpu_get_data_nlq)GetProcAddress(doviLib, "dovi_rpu_get_data_nlq");
@@ -41,29 +78,22 @@ DoViProcessor::DoViProcessor(const char* rpuPath, IScriptEnvironment* env)
 	dovi_rpu_get_data_mapping = (f_dovi_rpu_get_data_mapping)GetProcAddress(doviLib, "dovi_rpu_get_data_mapping");
 	dovi_rpu_free_data_mapping = (f_dovi_rpu_free_data_mapping)GetProcAddress(doviLib, "dovi_rpu_free_data_mapping");
 
-	rpus = dovi_parse_rpu_bin_file(rpuPath);
-	if (rpus->error) {
-		showMessage((std::string("DoViBaker: ")+rpus->error).c_str(), env);
+	// rpus are parsed on demand, the file is only indexed here
+	reader = std::make_unique<DoViRpuReader>(rpuPath, dovi_parse_unspec62_nalu, dovi_rpu_free);
+	if (!reader->isValid()) {
+		showMessage((std::string("DoViBaker: ") + reader->getError()).c_str(), env);
 		return;
 	}
 
-	pivot_value.resize(3);
-
-	mapping_idc.resize(3);
-	poly_order.resize(3);
-	fp_poly_coef.resize(3);
-
-	mmr_order.resize(3);
-	fp_mmr_const.resize(3);
-	fp_mmr_coef.resize(3);
-
 	successfulCreation = true;
 }
 
 DoViProcessor::~DoViProcessor()
 {
-	dovi_rpu_list_free(rpus);
-	::FreeLibrary(doviLib);
+	lookahead.reset(); // joins the thread, which still decodes through the reader and fills the tables cache
+	reader.reset(); // frees the parsed rpus, before the library is unloaded
+	if (doviLib)
+		::FreeLibrary(doviLib);
 }
 
 void DoViProcessor::showMessage(const char* message, IScriptEnvironment* env)
@@ -74,76 +104,203 @@ void DoViProcessor::showMessage(const char* message, IScriptEnvironment* env)
 		printf(message);
 }
 
+bool DoViProcessor::isFelSubprofile(const char* subprofile)
+{
+	std::string sp(subprofile);
+	std::transform(sp.begin(), sp.end(), sp.begin(),
+		[](unsigned char c) { return std::toupper(c); });
+	return (sp.compare("FEL") == 0);
+}
+
+bool DoViProcessor::requiresElProcessing(int frame) const {
+	// only peeks into the header, the state of the currently initialized frame is not touched
+	if (sidecar) {
+		const DoViFrameParams& p = sidecar->getFrameParams(sidecar->getFrameInfo(frame));
+		return p.is_fel && !p.disable_residual_flag;
+	}
+	if (rpuDecoder) {
+		DoViFrameParams p;
+		DoViFrameInfo info;
+		std::string error;
+		if (!decodeRpu(frame, p, info, error)) {
+			return true; // let intializeFrame report the error
+		}
+		return p.is_fel && !p.disable_residual_flag;
+	}
+	std::lock_guard<std::mutex> lock(decodeMutex);
+	const DoviRpuDataHeader* header = dovi_rpu_get_header(reader->getRpu(frame));
+	if (!header) {
+		return true; // let intializeFrame report the error
+	}
+	bool required = isFelSubprofile(header->subprofile) && !header->disable_residual_flag;
+	dovi_rpu_free_header(header);
+	return required;
+}
+
 bool DoViProcessor::intializeFrame(int frame, IScriptEnvironment* env) {
-	DoviRpuOpaque* rpu = rpus->list[frame];
+	if (sidecar) {
+		currentInfo = sidecar->getFrameInfo(frame);
+		currentParams = &sidecar->getFrameParams(currentInfo);
+	}
+	else {
+		bool prepared = lookahead && lookahead->take(frame, decoded, currentInfo);
+		if (!prepared && !decodeFrame(frame, decoded, currentInfo, env)) {
+			return false;
+		}
+		currentParams = &decoded;
+	}
+
+	if (currentParams->bl_bit_depth > blInputBitDepth || currentParams->el_bit_depth > elInputBitDepth) {
+		showMessage("DoViBaker: Input bit depth is lower than the bit depth signalled in the rpu.", env);
+		return false;
+	}
+
+	params = *currentParams;
+	disable_residual_flag = params.disable_residual_flag;
+	if (nlqProof) {
+		params.fp_linear_deadzone_slope[0] *= 4;
+	}
+
+	if (currentInfo.vdr_dm_metadata_present_flag) {
+		max_pq = currentInfo.max_pq;
+		//max_content_light_level = pq2nits(vdr_dm_data->source_max_pq);
+
+		//max_content_light_level = vdr_dm_data->dm_data.level6->max_content_light_level;
+		max_content_light_level = pq2nits(max_pq);
+
+		active_area_left_offset = currentInfo.active_area_left_offset;
+		active_area_right_offset = currentInfo.active_area_right_offset;
+		active_area_top_offset = currentInfo.active_area_top_offset;
+		active_area_bottom_offset = currentInfo.active_area_bottom_offset;
+
+		for (int i = 0; i < 9; i++) {
+			ycc_to_rgb_coef[i] = params.ycc_to_rgb_coef[i];
+		}
+		for (int i = 0; i < 3; i++) {
+			ycc_to_rgb_offset[i] = params.ycc_to_rgb_offset[i];
+		}
+
+		if (rgbProof) {
+			ycc_to_rgb_coef[0] *= 2;
+		}
+
+		scene_refresh_flag = currentInfo.scene_refresh_flag;
+		if (scene_refresh_flag) {
+			tablesCache.newScene(frame);
+		}
+	}
+
+	tables = compileTables(*currentParams, frame);
+	if (!tables->identity_checked) {
+		// the BL stands in for the composed frame, so it must be reproduced exactly and not only within the analyzer tolerance
+		tables->identity_mapping = checkExactIdentity();
+		tables->identity_checked = true;
+	}
+	identity_mapping = tables->identity_mapping;
+	standard_matrix = (checkMatrix() >> (containerBitDepth - 8)) == 0;
+	return successfulCreation;
+}
+
+bool DoViProcessor::decodeFrame(int frame, DoViFrameParams& p, DoViFrameInfo& info, IScriptEnvironment* env) {
+	std::string error;
+	if (!decodeRpu(frame, p, info, error)) {
+		showMessage((std::string("DoViBaker: ") + error).c_str(), env);
+		return false;
+	}
+	return true;
+}
+
+bool DoViProcessor::decodeRpu(int frame, DoViFrameParams& p, DoViFrameInfo& info, std::string& error) const {
+	if (sidecar) {
+		info = sidecar->getFrameInfo(frame);
+		p = sidecar->getFrameParams(info);
+		return true;
+	}
+
+	// neither the reader nor the decoders can be used from multiple threads
+	std::lock_guard<std::mutex> lock(decodeMutex);
+	if (rpuDecoder) {
+		size_t len;
+		const uint8_t* nalu = reader->getNalu(frame, len);
+		if (!rpuDecoder->decode(nalu, len, p, info)) {
+			error = rpuDecoder->getError();
+			return false;
+		}
+		return true;
+	}
+
+	// zero everything, such that identical rpus result in bytewise identical blocks
+	memset(&p, 0, sizeof(p));
+	memset(&info, 0, sizeof(info));
+
+	DoviRpuOpaque* rpu = reader->getRpu(frame);
 	const DoviRpuDataHeader* header = dovi_rpu_get_header(rpu);
 	if (!header) {
-		const char* error = dovi_rpu_get_error(rpu);
-		showMessage((std::string("DoViBaker: ") + error).c_str(), env);
+		error = dovi_rpu_get_error(rpu);
 		return false;
 	}
 
 	if (header->guessed_profile != 7) {
-		showMessage("DoViBaker: Expecting profile 7 rpu data.", env);
+		error = "Expecting profile 7 rpu data.";
+		dovi_rpu_free_header(header);
 		return false;
 	}
 	
-	std::string subprofile(header->subprofile);
-	std::transform(subprofile.begin(), subprofile.end(), subprofile.begin(),
-		[](unsigned char c) { return std::toupper(c); });
-	is_fel = (subprofile.compare("FEL")==0);
+	p.is_fel = isFelSubprofile(header->subprofile);
 
 	auto num_pivots_minus2 = header->num_pivots_minus_2;
 	auto pred_pivot_value = header->pred_pivot_value;
 	for (int cmp = 0; cmp < 3; cmp++) {
-		num_pivots_minus1[cmp] = num_pivots_minus2[cmp] + 1;
-		pivot_value[cmp] = std::vector<uint16_t>(num_pivots_minus1[cmp] + 1);
-		pivot_value[cmp][0] = pred_pivot_value[cmp].data[0];
-		for (int pivot_idx = 1; pivot_idx < num_pivots_minus1[cmp] + 1; pivot_idx++) {
-			pivot_value[cmp][pivot_idx] = pivot_value[cmp][pivot_idx - 1] + pred_pivot_value[cmp].data[pivot_idx];
+		if (num_pivots_minus2[cmp] + 1 > DoViFrameParams::maxPieces) {
+			error = "Unexpected number of pivots.";
+			dovi_rpu_free_header(header);
+			return false;
+		}
+		p.num_pivots_minus1[cmp] = num_pivots_minus2[cmp] + 1;
+		p.pivot_value[cmp][0] = pred_pivot_value[cmp].data[0];
+		for (int pivot_idx = 1; pivot_idx < p.num_pivots_minus1[cmp] + 1; pivot_idx++) {
+			p.pivot_value[cmp][pivot_idx] = p.pivot_value[cmp][pivot_idx - 1] + pred_pivot_value[cmp].data[pivot_idx];
 		}
 	}
 
-	out_bit_depth = header->vdr_bit_depth_minus_8 + 8;
-	bl_bit_depth = header->bl_bit_depth_minus8 + 8;
-	el_bit_depth = header->el_bit_depth_minus8 + 8;
-	coeff_log2_denom = header->coefficient_log2_denom;
-	disable_residual_flag = header->disable_residual_flag;
+	p.out_bit_depth = header->vdr_bit_depth_minus_8 + 8;
+	p.bl_bit_depth = header->bl_bit_depth_minus8 + 8;
+	p.el_bit_depth = header->el_bit_depth_minus8 + 8;
+	p.coeff_log2_denom = header->coefficient_log2_denom;
+	p.disable_residual_flag = header->disable_residual_flag;
 
 	if (header->nlq_method_idc != 0) {
 		//https://ffmpeg.org/doxygen/trunk/dovi__rpu_8c_source.html
-		showMessage("DoViBaker: Only method NLQ_LINEAR_DZ can be applied, NLQ_MU_LAW is not documented.", env);
+		error = "Only method NLQ_LINEAR_DZ can be applied, NLQ_MU_LAW is not documented.";
+		dovi_rpu_free_header(header);
 		return false;
 		//alternativlely we could just gracefully disable the nlq processing with disable_residual_flag=true
 	}
 	if (header->nlq_num_pivots_minus2 != 0) {
-		showMessage("DoViBaker: Expecting nlq_num_pivots_minus2 to be 0.", env);
+		error = "Expecting nlq_num_pivots_minus2 to be 0.";
+		dovi_rpu_free_header(header);
 		return false;
 		//alternativlely we could just gracefully disable the nlq processing with disable_residual_flag=true
 	}
 
 	const DoviRpuDataMapping* mapping_data = dovi_rpu_get_data_mapping(rpu);
 	if (!mapping_data) {
-		const char* error = dovi_rpu_get_error(rpu);
-		showMessage((std::string("DoViBaker: ") + error).c_str(), env);
+		error = dovi_rpu_get_error(rpu);
+		dovi_rpu_free_header(header);
 		return false;
 	}
 	auto poly_order_minus1 = mapping_data->poly_order_minus1;
 	auto poly_coef_int = mapping_data->poly_coef_int;
 	auto poly_coef = mapping_data->poly_coef;
 	for (int cmp = 0; cmp < 3; cmp++) {
-		mapping_idc[cmp] = std::vector<uint8_t>(num_pivots_minus1[cmp]);
-		poly_order[cmp] = std::vector<uint8_t>(num_pivots_minus1[cmp]);
-		fp_poly_coef[cmp] = std::vector<std::vector<int32_t>>(num_pivots_minus1[cmp]);
-		for (int pivot_idx = 0; pivot_idx < num_pivots_minus1[cmp]; pivot_idx++) {
-			mapping_idc[cmp][pivot_idx] = mapping_data->mapping_idc[cmp].data[0];
-			if (mapping_idc[cmp][pivot_idx] != 0) continue;
-			poly_order[cmp][pivot_idx] = poly_order_minus1[cmp].data[pivot_idx] + 1; 
-			fp_poly_coef[cmp][pivot_idx] = std::vector<int32_t>(poly_order[cmp][pivot_idx] + 1); // an order n equation has n+1 coefficients, thus +1!
-			for (int coeff = 0; coeff < poly_order[cmp][pivot_idx] + 1; coeff++) {  // an order n equation has n+1 coefficients, thus +1!
+		for (int pivot_idx = 0; pivot_idx < p.num_pivots_minus1[cmp]; pivot_idx++) {
+			p.mapping_idc[cmp][pivot_idx] = mapping_data->mapping_idc[cmp].data[pivot_idx];
+			if (p.mapping_idc[cmp][pivot_idx] != 0) continue;
+			p.poly_order[cmp][pivot_idx] = min(poly_order_minus1[cmp].data[pivot_idx] + 1, DoViFrameParams::maxPolyOrder);
+			for (int coeff = 0; coeff < p.poly_order[cmp][pivot_idx] + 1; coeff++) {  // an order n equation has n+1 coefficients, thus +1!
 				auto port_int = poly_coef_int[cmp].list[pivot_idx]->data[coeff];
 				auto port_frac = poly_coef[cmp].list[pivot_idx]->data[coeff];
-				fp_poly_coef[cmp][pivot_idx][coeff] = (port_int << coeff_log2_denom) + port_frac;
+				p.fp_poly_coef[cmp][pivot_idx][coeff] = (port_int << p.coeff_log2_denom) + port_frac;
 			}
 		}
 	}
@@ -155,22 +312,17 @@ bool DoViProcessor::intializeFrame(int frame, IScriptEnvironment* env) {
 	auto mmr_coef = mapping_data->mmr_coef;
 
 	for (int cmp = 0; cmp < 3; cmp++) {
-		mmr_order[cmp] = std::vector<uint8_t>(num_pivots_minus1[cmp]);
-		fp_mmr_const[cmp] = std::vector<int32_t>(num_pivots_minus1[cmp]);
-		fp_mmr_coef[cmp] = std::vector<std::vector<std::vector<int32_t>>>(num_pivots_minus1[cmp]);
-		for (int pivot_idx = 0; pivot_idx < num_pivots_minus1[cmp]; pivot_idx++) {
-			if (mapping_idc[cmp][pivot_idx] != 1) continue;
-			mmr_order[cmp][pivot_idx] = mmr_order_minus1[cmp].data[pivot_idx] + 1;
+		for (int pivot_idx = 0; pivot_idx < p.num_pivots_minus1[cmp]; pivot_idx++) {
+			if (p.mapping_idc[cmp][pivot_idx] != 1) continue;
+			p.mmr_order[cmp][pivot_idx] = min(mmr_order_minus1[cmp].data[pivot_idx] + 1, DoViFrameParams::maxMmrOrder);
 			auto constant_int = mmr_constant_int[cmp].data[pivot_idx];
 			auto constant = mmr_constant[cmp].data[pivot_idx];
-			fp_mmr_const[cmp][pivot_idx] = (constant_int << coeff_log2_denom) + constant;
-			fp_mmr_coef[cmp][pivot_idx] = std::vector<std::vector<int32_t>>(mmr_order[cmp][pivot_idx] + 1); // an order n equation has n+1 coefficients, thus +1!
-			for (int i = 0; i < mmr_order[cmp][pivot_idx] + 1; i++) { // an order n equation has n+1 coefficients, thus +1!
-				fp_mmr_coef[cmp][pivot_idx][i] = std::vector<int32_t>(7);
+			p.fp_mmr_const[cmp][pivot_idx] = (constant_int << p.coeff_log2_denom) + constant;
+			for (int i = 0; i < p.mmr_order[cmp][pivot_idx] + 1; i++) { // an order n equation has n+1 coefficients, thus +1!
 				for (int j = 0; j < 7; j++) {
 					auto port_int = mmr_coef_int[cmp].list[pivot_idx]->list[i]->data[j];
 					auto port_frac = mmr_coef[cmp].list[pivot_idx]->list[i]->data[j];
-					fp_mmr_coef[cmp][pivot_idx][i][j] = (port_int << coeff_log2_denom) + port_frac;
+					p.fp_mmr_coef[cmp][pivot_idx][i][j] = (port_int << p.coeff_log2_denom) + port_frac;
 				}
 			}
 		}
@@ -178,8 +330,9 @@ bool DoViProcessor::intializeFrame(int frame, IScriptEnvironment* env) {
 
 	const DoviRpuDataNlq* nlq_data = dovi_rpu_get_data_nlq(rpu);
 	if (!nlq_data) {
-		const char* error = dovi_rpu_get_error(rpu);
-		showMessage((std::string("DoViBaker: ") + error).c_str(), env);
+		error = dovi_rpu_get_error(rpu);
+		dovi_rpu_free_data_mapping(mapping_data);
+		dovi_rpu_free_header(header);
 		return false;
 	}
 	auto nlq_offsets = nlq_data->nlq_offset.list[0];
@@ -191,48 +344,51 @@ bool DoViProcessor::intializeFrame(int frame, IScriptEnvironment* env) {
 	auto linear_deadzone_threshold = nlq_data->linear_deadzone_threshold.list[0];
 
 	for (int cmp = 0; cmp < 3; cmp++) {
-		nlq_offset[cmp] = nlq_offsets->data[cmp];
-		fp_hdr_in_max[cmp] = (vdr_in_max_int->data[cmp] << coeff_log2_denom) + vdr_in_max->data[cmp];
-		fp_linear_deadzone_slope[cmp] = (linear_deadzone_slope_int->data[cmp] << coeff_log2_denom) + linear_deadzone_slope->data[cmp];
-		fp_linear_deadzone_threshold[cmp] = (linear_deadzone_threshold_int->data[cmp] << coeff_log2_denom) + linear_deadzone_threshold->data[cmp];
-	}
-	if (nlqProof) {
-		fp_linear_deadzone_slope[0] *= 4;
+		p.nlq_offset[cmp] = nlq_offsets->data[cmp];
+		p.fp_hdr_in_max[cmp] = (vdr_in_max_int->data[cmp] << p.coeff_log2_denom) + vdr_in_max->data[cmp];
+		p.fp_linear_deadzone_slope[cmp] = (linear_deadzone_slope_int->data[cmp] << p.coeff_log2_denom) + linear_deadzone_slope->data[cmp];
+		p.fp_linear_deadzone_threshold[cmp] = (linear_deadzone_threshold_int->data[cmp] << p.coeff_log2_denom) + linear_deadzone_threshold->data[cmp];
 	}
 
 	if (header->vdr_dm_metadata_present_flag) {
 		const DoviVdrDmData* vdr_dm_data = dovi_rpu_get_vdr_dm_data(rpu);
 		if (!vdr_dm_data) {
-			const char* error = dovi_rpu_get_error(rpu);
-			showMessage((std::string("DoViBaker: ") + error).c_str(), env);
+			error = dovi_rpu_get_error(rpu);
+			dovi_rpu_free_data_mapping(mapping_data);
+			dovi_rpu_free_data_nlq(nlq_data);
+			dovi_rpu_free_header(header);
 			return false;
 		}
 
-		max_pq = vdr_dm_data->dm_data.level1->max_pq;
-		//max_content_light_level = pq2nits(vdr_dm_data->source_max_pq);
-
-		//max_content_light_level = vdr_dm_data->dm_data.level6->max_content_light_level;
-		max_content_light_level = pq2nits(max_pq);
-
-		ycc_to_rgb_coef[0] = vdr_dm_data->ycc_to_rgb_coef0;
-		ycc_to_rgb_coef[1] = vdr_dm_data->ycc_to_rgb_coef1;
-		ycc_to_rgb_coef[2] = vdr_dm_data->ycc_to_rgb_coef2;
-		ycc_to_rgb_coef[3] = vdr_dm_data->ycc_to_rgb_coef3;
-		ycc_to_rgb_coef[4] = vdr_dm_data->ycc_to_rgb_coef4;
-		ycc_to_rgb_coef[5] = vdr_dm_data->ycc_to_rgb_coef5;
-		ycc_to_rgb_coef[6] = vdr_dm_data->ycc_to_rgb_coef6;
-		ycc_to_rgb_coef[7] = vdr_dm_data->ycc_to_rgb_coef7;
-		ycc_to_rgb_coef[8] = vdr_dm_data->ycc_to_rgb_coef8;
-
-		ycc_to_rgb_offset[0] = vdr_dm_data->ycc_to_rgb_offset0 >> ycc_to_rgb_offset_scale_shifts;
-		ycc_to_rgb_offset[1] = vdr_dm_data->ycc_to_rgb_offset1 >> ycc_to_rgb_offset_scale_shifts;
-		ycc_to_rgb_offset[2] = vdr_dm_data->ycc_to_rgb_offset2 >> ycc_to_rgb_offset_scale_shifts;
-
-		if (rgbProof) {
-			ycc_to_rgb_coef[0] *= 2;
+		info.vdr_dm_metadata_present_flag = 1;
+		info.scene_refresh_flag = vdr_dm_data->scene_refresh_flag;
+		if (vdr_dm_data->dm_data.level1) {
+			info.max_pq = vdr_dm_data->dm_data.level1->max_pq;
+		}
+		if (vdr_dm_data->dm_data.level5) {
+			info.active_area_left_offset = vdr_dm_data->dm_data.level5->active_area_left_offset;
+			info.active_area_right_offset = vdr_dm_data->dm_data.level5->active_area_right_offset;
+			info.active_area_top_offset = vdr_dm_data->dm_data.level5->active_area_top_offset;
+			info.active_area_bottom_offset = vdr_dm_data->dm_data.level5->active_area_bottom_offset;
+		}
+		if (vdr_dm_data->dm_data.level6) {
+			info.max_content_light_level = vdr_dm_data->dm_data.level6->max_content_light_level;
+			info.max_frame_average_light_level = vdr_dm_data->dm_data.level6->max_frame_average_light_level;
 		}
 
-		scene_refresh_flag = vdr_dm_data->scene_refresh_flag;
+		p.ycc_to_rgb_coef[0] = vdr_dm_data->ycc_to_rgb_coef0;
+		p.ycc_to_rgb_coef[1] = vdr_dm_data->ycc_to_rgb_coef1;
+		p.ycc_to_rgb_coef[2] = vdr_dm_data->ycc_to_rgb_coef2;
+		p.ycc_to_rgb_coef[3] = vdr_dm_data->ycc_to_rgb_coef3;
+		p.ycc_to_rgb_coef[4] = vdr_dm_data->ycc_to_rgb_coef4;
+		p.ycc_to_rgb_coef[5] = vdr_dm_data->ycc_to_rgb_coef5;
+		p.ycc_to_rgb_coef[6] = vdr_dm_data->ycc_to_rgb_coef6;
+		p.ycc_to_rgb_coef[7] = vdr_dm_data->ycc_to_rgb_coef7;
+		p.ycc_to_rgb_coef[8] = vdr_dm_data->ycc_to_rgb_coef8;
+
+		p.ycc_to_rgb_offset[0] = vdr_dm_data->ycc_to_rgb_offset0 >> ycc_to_rgb_offset_scale_shifts;
+		p.ycc_to_rgb_offset[1] = vdr_dm_data->ycc_to_rgb_offset1 >> ycc_to_rgb_offset_scale_shifts;
+		p.ycc_to_rgb_offset[2] = vdr_dm_data->ycc_to_rgb_offset2 >> ycc_to_rgb_offset_scale_shifts;
 
 		dovi_rpu_free_vdr_dm_data(vdr_dm_data);
 	}
@@ -240,36 +396,321 @@ bool DoViProcessor::intializeFrame(int frame, IScriptEnvironment* env) {
 	dovi_rpu_free_data_mapping(mapping_data);
 	dovi_rpu_free_data_nlq(nlq_data);
 	dovi_rpu_free_header(header);
-	return successfulCreation;
+	return true;
+}
+
+void DoViProcessor::enableLookahead(int depth) {
+	if (sidecar) {
+		return; // the parameters are precompiled already
+	}
+	lookahead = std::make_unique<DoViLookahead>(getClipLength(), depth, [this](int frame, DoViFrameParams& p, DoViFrameInfo& info) { return prepareFrame(frame, p, info); });
+}
+
+bool DoViProcessor::prepareFrame(int frame, DoViFrameParams& p, DoViFrameInfo& info) {
+	// runs on the lookahead thread, must not touch the state of the current frame
+	std::string error;
+	if (!decodeRpu(frame, p, info, error)) {
+		return false;
+	}
+	compileTables(p, frame);
+	return true;
+}
+
+std::shared_ptr<DoViDerivedTables> DoViProcessor::compileTables(const DoViFrameParams& p, int frame) {
+	// within a scene the block mostly repeats, so the tables only need to be built once
+	uint64_t hash = hashFrameParams(p);
+	std::shared_ptr<DoViDerivedTables> t = tablesCache.find(p, hash, frame);
+	if (t) {
+		return t;
+	}
+	// the tables include the proof modifications, the key does not
+	DoViFrameParams modified = p;
+	if (nlqProof) {
+		modified.fp_linear_deadzone_slope[0] *= 4;
+	}
+	t = std::make_shared<DoViDerivedTables>();
+	t->params = p;
+	t->identity_checked = false;
+	t->identity_mapping = false;
+	buildTables(*t, modified);
+	if (approxMmr) {
+		buildMmrApproximation(*t, modified);
+	}
+	if (chromaTable) {
+		buildChromaTable(*t, modified);
+	}
+	tablesCache.insert(hash, t, frame);
+	return t;
+}
+
+void DoViProcessor::buildTables(DoViDerivedTables& t, const DoViFrameParams& p) {
+	const int blRange = 1 << p.bl_bit_depth;
+	const int elRange = 1 << p.el_bit_depth;
+	for (int cmp = 0; cmp < 3; cmp++) {
+		t.mappingLut[cmp].resize(blRange);
+		t.pieceLut[cmp].resize(blRange);
+		for (int s = 0; s < blRange; s++) {
+			int pivot_idx = getPivotIndex(p, cmp, s);
+			t.pieceLut[cmp][s] = pivot_idx;
+			if (cmp == 0 || p.mapping_idc[cmp][pivot_idx] == 0)
+				t.mappingLut[cmp][s] = polynompialMapping(p, cmp, pivot_idx, s);
+			else
+				t.mappingLut[cmp][s] = 0;
+		}
+		t.nlqLut[cmp].resize(elRange);
+		for (int e = 0; e < elRange; e++) {
+			t.nlqLut[cmp][e] = nonLinearInverseQuantization(p, cmp, e);
+		}
+		for (int pivot_idx = 0; pivot_idx < DoViFrameParams::maxPieces; pivot_idx++) {
+			int32_t* packed = t.mmrPacked[cmp][pivot_idx];
+			packed[0] = p.fp_mmr_const[cmp][pivot_idx];
+			for (int i = 1; i <= DoViFrameParams::maxMmrOrder; i++) {
+				for (int j = 0; j < 7; j++) {
+					packed[1 + 7 * (i - 1) + j] = p.fp_mmr_coef[cmp][pivot_idx][i][j];
+				}
+			}
+		}
+	}
+}
+
+void DoViProcessor::buildMmrApproximation(DoViDerivedTables& t, const DoViFrameParams& p) const {
+	// the fixed point result is scaled by 2^(20 - 4 - coeff_log2_denom), the float terms are normalized to 1
+	const float scale = ldexpf(1.0f, 16 - p.coeff_log2_denom);
+	// deviations up to one step of the output depth are accepted
+	const int maxDeviation = 1 << (16 - p.out_bit_depth);
+	static const int gridPoints = 17;
+
+	for (int cmp = 1; cmp < 3; cmp++) {
+		for (int pivot_idx = 0; pivot_idx < DoViFrameParams::maxPieces; pivot_idx++) {
+			t.mmrApprox[cmp][pivot_idx] = false;
+			const int order = p.mmr_order[cmp][pivot_idx];
+			t.mmrFloatConst[cmp][pivot_idx] = p.fp_mmr_const[cmp][pivot_idx] * scale;
+			for (int i = 0; i < DoViFrameParams::maxMmrOrder; i++) {
+				for (int k = 0; k < 8; k++) {
+					const bool used = k < 7 && i < order;
+					t.mmrFloat[cmp][pivot_idx][i][k] = used ? p.fp_mmr_coef[cmp][pivot_idx][i + 1][k] * scale : 0.0f;
+				}
+			}
+			if (pivot_idx >= p.num_pivots_minus1[cmp] || p.mapping_idc[cmp][pivot_idx] != 1) {
+				continue;
+			}
+
+			// the component of the piece only covers its own pivot range, the other two their full range
+			int lo[3], hi[3];
+			for (int c = 0; c < 3; c++) {
+				lo[c] = p.pivot_value[c][0];
+				hi[c] = p.pivot_value[c][p.num_pivots_minus1[c]];
+			}
+			lo[cmp] = p.pivot_value[cmp][pivot_idx];
+			hi[cmp] = p.pivot_value[cmp][pivot_idx + 1];
+
+			int deviation = 0;
+			for (int i0 = 0; i0 < gridPoints; i0++) {
+				const uint16_t s0 = lo[0] + (hi[0] - lo[0]) * i0 / (gridPoints - 1);
+				for (int i1 = 0; i1 < gridPoints; i1++) {
+					const uint16_t s1 = lo[1] + (hi[1] - lo[1]) * i1 / (gridPoints - 1);
+					for (int i2 = 0; i2 < gridPoints; i2++) {
+						const uint16_t s2 = lo[2] + (hi[2] - lo[2]) * i2 / (gridPoints - 1);
+						const int exact = mmrMapping(p, t, cmp, pivot_idx, s0, s1, s2);
+						const int approx = mmrMappingFloat(p, t, cmp, pivot_idx, s0, s1, s2);
+						deviation = max(deviation, std::abs(exact - approx));
+					}
+				}
+			}
+			t.mmrApprox[cmp][pivot_idx] = deviation <= maxDeviation;
+		}
+	}
+}
+
+void DoViProcessor::buildChromaTable(DoViDerivedTables& t, const DoViFrameParams& p) {
+	t.chromaLut.reset();
+	bool hasMmr = false;
+	for (int cmp = 1; cmp < 3; cmp++) {
+		for (int pivot_idx = 0; pivot_idx < p.num_pivots_minus1[cmp]; pivot_idx++) {
+			hasMmr |= p.mapping_idc[cmp][pivot_idx] == 1;
+		}
+	}
+	if (!hasMmr) {
+		return; // the polynomial pieces are fully tabulated already
+	}
+
+	// the nodes lie on BL sample values, the input is normalized to 1 << bl_bit_depth such that the domain stays 0 to 1
+	static const int nodes = 33;
+	const int step = (1 << p.bl_bit_depth) / (nodes - 1);
+	const float outScale = 1.0f / 65536;
+	timecube::Cube cube;
+	cube.n = nodes;
+	cube.is_3d = true;
+	cube.lut.resize(nodes * nodes * nodes * 3);
+	size_t idx = 0;
+	for (int k = 0; k < nodes; k++) {
+		for (int j = 0; j < nodes; j++) {
+			for (int i = 0; i < nodes; i++) {
+				cube.lut[idx++] = chromaMapping(p, t, 1, i * step, j * step, k * step) * outScale;
+				cube.lut[idx++] = chromaMapping(p, t, 2, i * step, j * step, k * step) * outScale;
+				cube.lut[idx++] = 0.0f;
+			}
+		}
+	}
+	std::unique_ptr<timecube::Lut> lut = timecube::create_lut_impl(cube, INT_MAX);
+
+	// the interpolation error is largest in the center of the cells, all of them are compared against the exact mapping
+	const int cells = nodes - 1;
+	const int count = cells * cells * cells;
+	const float inScale = 1.0f / (1 << p.bl_bit_depth);
+	ScratchArena::Scope scratch;
+	float* buf = scratch.alloc<float>(count * 6);
+	float* in[3] = { buf, buf + count, buf + count * 2 };
+	float* out[3] = { buf + count * 3, buf + count * 4, buf + count * 5 };
+	idx = 0;
+	for (int k = 0; k < cells; k++) {
+		for (int j = 0; j < cells; j++) {
+			for (int i = 0; i < cells; i++) {
+				in[0][idx] = (i * step + step / 2) * inScale;
+				in[1][idx] = (j * step + step / 2) * inScale;
+				in[2][idx] = (k * step + step / 2) * inScale;
+				idx++;
+			}
+		}
+	}
+	lut->process(in, out, count);
+
+	// deviations up to one step of the output depth are accepted
+	const int maxDeviation = 1 << (16 - p.out_bit_depth);
+	idx = 0;
+	for (int k = 0; k < cells; k++) {
+		for (int j = 0; j < cells; j++) {
+			for (int i = 0; i < cells; i++) {
+				const uint16_t sy = i * step + step / 2;
+				const uint16_t su = j * step + step / 2;
+				const uint16_t sv = k * step + step / 2;
+				const int u = min(int(out[0][idx] * 65536.0f + 0.5f), 0xFFFF);
+				const int v = min(int(out[1][idx] * 65536.0f + 0.5f), 0xFFFF);
+				if (std::abs(u - chromaMapping(p, t, 1, sy, su, sv)) > maxDeviation || std::abs(v - chromaMapping(p, t, 2, sy, su, sv)) > maxDeviation) {
+					return;
+				}
+				idx++;
+			}
+		}
+	}
+	t.chromaLut = std::move(lut);
 }
 
 uint16_t DoViProcessor::processSample(int cmp, uint16_t bl, uint16_t el, uint16_t mmrBlY, uint16_t mmrBlU, uint16_t mmrBlV) const {
-	bl >>= (containerBitDepth - bl_bit_depth);
-	int pivot_idx = getPivotIndex(cmp, bl);
+	// upsampled samples may overshoot the input range when it is below the container depth
+	bl >>= (blInputBitDepth - params.bl_bit_depth);
+	bl = min(bl, uint16_t((1 << params.bl_bit_depth) - 1));
+	int pivot_idx = tables->pieceLut[cmp][bl];
 	int v;
-	if (cmp == 0 || mapping_idc[cmp][pivot_idx] == 0) {
-		v = polynompialMapping(cmp, pivot_idx, bl);
+	if (cmp == 0 || params.mapping_idc[cmp][pivot_idx] == 0) {
+		v = tables->mappingLut[cmp][bl];
 	}
 	else {
-		mmrBlY >>= (containerBitDepth - bl_bit_depth);
-		mmrBlU >>= (containerBitDepth - bl_bit_depth);
-		mmrBlV >>= (containerBitDepth - bl_bit_depth);
-		v = mmrMapping(cmp, pivot_idx, mmrBlY, mmrBlU, mmrBlV);
+		mmrBlY >>= (blInputBitDepth - params.bl_bit_depth);
+		mmrBlU >>= (blInputBitDepth - params.bl_bit_depth);
+		mmrBlV >>= (blInputBitDepth - params.bl_bit_depth);
+		v = tables->mmrApprox[cmp][pivot_idx] ? mmrMappingFloat(params, *tables, cmp, pivot_idx, mmrBlY, mmrBlU, mmrBlV) : mmrMapping(params, *tables, cmp, pivot_idx, mmrBlY, mmrBlU, mmrBlV);
 	}
+	return processMappedSample(cmp, v, el);
+}
+
+uint16_t DoViProcessor::processMappedSample(int cmp, int v, uint16_t el) const {
 	int r = 0;
 	if (!disable_residual_flag) {
-		el >>= (containerBitDepth - el_bit_depth);
-		r = nonLinearInverseQuantization(cmp, el);
+		el >>= (elInputBitDepth - params.el_bit_depth);
+		el = min(el, uint16_t((1 << params.el_bit_depth) - 1));
+		r = tables->nlqLut[cmp][el];
 	}
 	uint16_t h = signalReconstruction(v, r);
-	h <<= (containerBitDepth - out_bit_depth);
+	h <<= (containerBitDepth - params.out_bit_depth);
 	return h;
 }
 
-int DoViProcessor::getPivotIndex(int cmp, uint16_t s) const {
-	int pivot_idx = num_pivots_minus1[cmp];
-	for (int idx = 0; idx < num_pivots_minus1[cmp]; idx++) {
-		if (s < pivot_value[cmp][idx + 1]) {
+bool DoViProcessor::mapChromaRow(uint16_t* mappedU, uint16_t* mappedV, const uint16_t* mmrBlY, const uint16_t* blU, const uint16_t* blV, int width) const
+{
+	const timecube::Lut* lut = tables->chromaLut.get();
+	if (!lut) {
+		return false;
+	}
+	// the lut processes whole vectors of up to 16 floats, the padding must hold valid values
+	const int alignedWidth = (width + 15) & ~15;
+	ScratchArena::Scope scratch;
+	float* buf = scratch.alloc<float>(alignedWidth * 6);
+	std::fill_n(buf, alignedWidth * 6, 0.0f);
+	float* in[3] = { buf, buf + alignedWidth, buf + alignedWidth * 2 };
+	float* out[3] = { buf + alignedWidth * 3, buf + alignedWidth * 4, buf + alignedWidth * 5 };
+
+	const int shift = blInputBitDepth - params.bl_bit_depth;
+	const int maxSample = (1 << params.bl_bit_depth) - 1;
+	const float scale = 1.0f / (1 << params.bl_bit_depth);
+	for (int x = 0; x < width; x++) {
+		in[0][x] = min(mmrBlY[x] >> shift, maxSample) * scale;
+		in[1][x] = min(blU[x] >> shift, maxSample) * scale;
+		in[2][x] = min(blV[x] >> shift, maxSample) * scale;
+	}
+	lut->process(in, out, alignedWidth);
+	for (int x = 0; x < width; x++) {
+		mappedU[x] = uint16_t(min(int(out[0][x] * 65536.0f + 0.5f), 0xFFFF));
+		mappedV[x] = uint16_t(min(int(out[1][x] * 65536.0f + 0.5f), 0xFFFF));
+	}
+	return true;
+}
+
+void DoViProcessor::sample2rgbRow(uint16_t* r, uint16_t* g, uint16_t* b, const uint16_t* y, const uint16_t* u, const uint16_t* v, int width, int chromaShift) const
+{
+	int x = 0;
+	if (sse41) {
+		// same fixed point arithmetic as sample2rgb in 32bit lanes, packus does the clipping
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i offY = _mm_set1_epi32(ycc_to_rgb_offset[0]);
+		const __m128i offU = _mm_set1_epi32(ycc_to_rgb_offset[1]);
+		const __m128i offV = _mm_set1_epi32(ycc_to_rgb_offset[2]);
+		__m128i coef[9];
+		for (int i = 0; i < 9; i++) {
+			coef[i] = _mm_set1_epi32(ycc_to_rgb_coef[i]);
+		}
+		uint16_t* dst[3] = { r, g, b };
+
+		for (; x + 8 <= width; x += 8) {
+			const __m128i ys = _mm_loadu_si128((const __m128i*)(y + x));
+			__m128i us, vs;
+			if (chromaShift) {
+				// nearest neighbour, each chroma sample is duplicated for the two luma samples it covers
+				us = _mm_loadl_epi64((const __m128i*)(u + (x >> 1)));
+				vs = _mm_loadl_epi64((const __m128i*)(v + (x >> 1)));
+				us = _mm_unpacklo_epi16(us, us);
+				vs = _mm_unpacklo_epi16(vs, vs);
+			}
+			else {
+				us = _mm_loadu_si128((const __m128i*)(u + x));
+				vs = _mm_loadu_si128((const __m128i*)(v + x));
+			}
+			const __m128i yf[2] = { _mm_sub_epi32(_mm_unpacklo_epi16(ys, zero), offY), _mm_sub_epi32(_mm_unpackhi_epi16(ys, zero), offY) };
+			const __m128i uf[2] = { _mm_sub_epi32(_mm_unpacklo_epi16(us, zero), offU), _mm_sub_epi32(_mm_unpackhi_epi16(us, zero), offU) };
+			const __m128i vf[2] = { _mm_sub_epi32(_mm_unpacklo_epi16(vs, zero), offV), _mm_sub_epi32(_mm_unpackhi_epi16(vs, zero), offV) };
+
+			for (int c = 0; c < 3; c++) {
+				__m128i res[2];
+				for (int i = 0; i < 2; i++) {
+					__m128i acc = _mm_mullo_epi32(coef[3 * c], yf[i]);
+					acc = _mm_add_epi32(acc, _mm_mullo_epi32(coef[3 * c + 1], uf[i]));
+					acc = _mm_add_epi32(acc, _mm_mullo_epi32(coef[3 * c + 2], vf[i]));
+					res[i] = _mm_srai_epi32(acc, ycc_to_rgb_coef_scale_shifts);
+				}
+				_mm_storeu_si128((__m128i*)(dst[c] + x), _mm_packus_epi32(res[0], res[1]));
+			}
+		}
+	}
+	for (; x < width; x++) {
+		sample2rgb(r[x], g[x], b[x], y[x], u[x >> chromaShift], v[x >> chromaShift]);
+	}
+}
+
+int DoViProcessor::getPivotIndex(const DoViFrameParams& p, int cmp, uint16_t s) {
+	// samples above the last pivot belong to the last piece, they are clipped by the mapping
+	int pivot_idx = p.num_pivots_minus1[cmp] - 1;
+	for (int idx = 0; idx < p.num_pivots_minus1[cmp]; idx++) {
+		if (s < p.pivot_value[cmp][idx + 1]) {
 			pivot_idx = idx;
 			break;
 		}
@@ -277,66 +718,70 @@ int DoViProcessor::getPivotIndex(int cmp, uint16_t s) const {
 	return pivot_idx;
 }
 
-uint16_t DoViProcessor::polynompialMapping(int cmp, int pivot_idx, uint16_t s) const {
-	if (s < pivot_value[cmp][0])
-		s = pivot_value[cmp][0];
-	if (s > pivot_value[cmp][num_pivots_minus1[cmp]])
-		s = pivot_value[cmp][num_pivots_minus1[cmp]];
+uint16_t DoViProcessor::polynompialMapping(const DoViFrameParams& p, int cmp, int pivot_idx, uint16_t s) {
+	if (s < p.pivot_value[cmp][0])
+		s = p.pivot_value[cmp][0];
+	if (s > p.pivot_value[cmp][p.num_pivots_minus1[cmp]])
+		s = p.pivot_value[cmp][p.num_pivots_minus1[cmp]];
 	// compute polynom at s in fixed point arithmetic
 	int64_t ss = 1;
 	int64_t shift = 20; // 2*(maximum BL_bit_depth)
 	int64_t vv = 0;
-	for (int i = 0; i <= poly_order[cmp][pivot_idx]; i++)
+	for (int i = 0; i <= p.poly_order[cmp][pivot_idx]; i++)
 	{
-		vv += fp_poly_coef[cmp][pivot_idx][i] * (ss << shift);
+		vv += p.fp_poly_coef[cmp][pivot_idx][i] * (ss << shift);
 		ss *= s;
-		shift -= bl_bit_depth;
+		shift -= p.bl_bit_depth;
 	}
 	vv = (vv < 0) ? 0 : vv;
-	int64_t v = vv >> (4 + coeff_log2_denom);
+	int64_t v = vv >> (4 + p.coeff_log2_denom);
 	v = (v > 0xffff) ? 0xffff : v;
 	return v;
 }
 
-uint16_t DoViProcessor::mmrMapping(int cmp, int pivot_idx, uint16_t s0, uint16_t s1, uint16_t s2) const {
-	if (s0 < pivot_value[0][0])
-		s0 = pivot_value[0][0];
-	if (s0 > pivot_value[0][num_pivots_minus1[0]])
-		s0 = pivot_value[0][num_pivots_minus1[0]];
-	if (s1 < pivot_value[1][0])
-		s1 = pivot_value[1][0];
-	if (s1 > pivot_value[1][num_pivots_minus1[1]])
-		s1 = pivot_value[1][num_pivots_minus1[1]];
-	if (s2 < pivot_value[2][0])
-		s2 = pivot_value[2][0];
-	if (s2 > pivot_value[2][num_pivots_minus1[2]])
-		s2 = pivot_value[2][num_pivots_minus1[2]];
+void DoViProcessor::clipMmrInputs(const DoViFrameParams& p, uint16_t& s0, uint16_t& s1, uint16_t& s2) {
+	if (s0 < p.pivot_value[0][0])
+		s0 = p.pivot_value[0][0];
+	if (s0 > p.pivot_value[0][p.num_pivots_minus1[0]])
+		s0 = p.pivot_value[0][p.num_pivots_minus1[0]];
+	if (s1 < p.pivot_value[1][0])
+		s1 = p.pivot_value[1][0];
+	if (s1 > p.pivot_value[1][p.num_pivots_minus1[1]])
+		s1 = p.pivot_value[1][p.num_pivots_minus1[1]];
+	if (s2 < p.pivot_value[2][0])
+		s2 = p.pivot_value[2][0];
+	if (s2 > p.pivot_value[2][p.num_pivots_minus1[2]])
+		s2 = p.pivot_value[2][p.num_pivots_minus1[2]];
+}
+
+uint16_t DoViProcessor::mmrMapping(const DoViFrameParams& p, const DoViDerivedTables& t, int cmp, int pivot_idx, uint16_t s0, uint16_t s1, uint16_t s2) {
+	clipMmrInputs(p, s0, s1, s2);
 	// constant
 	int64_t tt[22];
 	tt[0] = 1 << 20;
 	//num_coeff = 1;
 	// first order
-	if (mmr_order[cmp][pivot_idx] >= 1) {
-		tt[1] = s0 << (20 - bl_bit_depth);
-		tt[2] = s1 << (20 - bl_bit_depth);
-		tt[3] = s2 << (20 - bl_bit_depth);
-		tt[4] = (s0 * s1) << (20 - 2 * bl_bit_depth);
-		tt[5] = (s0 * s2) << (20 - 2 * bl_bit_depth);
-		tt[6] = (s1 * s2) << (20 - 2 * bl_bit_depth);
+	if (p.mmr_order[cmp][pivot_idx] >= 1) {
+		tt[1] = s0 << (20 - p.bl_bit_depth);
+		tt[2] = s1 << (20 - p.bl_bit_depth);
+		tt[3] = s2 << (20 - p.bl_bit_depth);
+		tt[4] = (s0 * s1) << (20 - 2 * p.bl_bit_depth);
+		tt[5] = (s0 * s2) << (20 - 2 * p.bl_bit_depth);
+		tt[6] = (s1 * s2) << (20 - 2 * p.bl_bit_depth);
 		tt[7] = (tt[4] * tt[3]) >> 20;
 	}
 	// second order
-	if (mmr_order[cmp][pivot_idx] >= 2) {
-		tt[8] = (s0 * s0) << (20 - 2 * bl_bit_depth);
-		tt[9] = (s1 * s1) << (20 - 2 * bl_bit_depth);
-		tt[10] = (s2 * s2) << (20 - 2 * bl_bit_depth);
+	if (p.mmr_order[cmp][pivot_idx] >= 2) {
+		tt[8] = (s0 * s0) << (20 - 2 * p.bl_bit_depth);
+		tt[9] = (s1 * s1) << (20 - 2 * p.bl_bit_depth);
+		tt[10] = (s2 * s2) << (20 - 2 * p.bl_bit_depth);
 		tt[11] = (tt[4] * tt[4]) >> 20;
 		tt[12] = (tt[5] * tt[5]) >> 20;
 		tt[13] = (tt[6] * tt[6]) >> 20;
 		tt[14] = (tt[7] * tt[7]) >> 20;
 	}
 	// third order
-	if (mmr_order[cmp][pivot_idx] >= 3) {
+	if (p.mmr_order[cmp][pivot_idx] >= 3) {
 		tt[15] = (tt[1] * tt[8]) >> 20;
 		tt[16] = (tt[2] * tt[9]) >> 20;
 		tt[17] = (tt[3] * tt[10]) >> 20;
@@ -345,27 +790,66 @@ uint16_t DoViProcessor::mmrMapping(int cmp, int pivot_idx, uint16_t s0, uint16_t
 		tt[20] = (tt[6] * tt[13]) >> 20;
 		tt[21] = (tt[7] * tt[14]) >> 20;
 	}
-	int64_t rr = fp_mmr_const[cmp][pivot_idx] * tt[0];
-	int cnt = 1;
-	for (int i = 1; i <= mmr_order[cmp][pivot_idx]; i++) {
-		for (int j = 0; j < 7; j++) {
-			rr += fp_mmr_coef[cmp][pivot_idx][i][j] * tt[cnt];
-			cnt++;
-		}
+	const int32_t* packed = t.mmrPacked[cmp][pivot_idx];
+	const int numCoef = 1 + 7 * p.mmr_order[cmp][pivot_idx];
+	int64_t rr = 0;
+	for (int cnt = 0; cnt < numCoef; cnt++) {
+		rr += packed[cnt] * tt[cnt];
 	}
 	rr = rr < 0 ? 0 : rr;
-	int64_t v = (rr >> (4 + coeff_log2_denom));
+	int64_t v = (rr >> (4 + p.coeff_log2_denom));
 	v = v > 0xffff ? 0xffff : v;
 	return v;
 }
 
-int16_t DoViProcessor::nonLinearInverseQuantization(int cmp, uint16_t e) const {
+uint16_t DoViProcessor::mmrMappingFloat(const DoViFrameParams& p, const DoViDerivedTables& t, int cmp, int pivot_idx, uint16_t s0, uint16_t s1, uint16_t s2) const {
+	clipMmrInputs(p, s0, s1, s2);
+	const float scale = 1.0f / (1 << p.bl_bit_depth);
+	const float x = s0 * scale;
+	const float y = s1 * scale;
+	const float z = s2 * scale;
+	// the higher orders are powers of the first order terms, so each term is a polynomial evaluated with horner
+	alignas(32) const float m[8] = { x, y, z, x * y, x * z, y * z, x * y * z, 0.0f };
+	const float (*c)[8] = t.mmrFloat[cmp][pivot_idx];
+	float v;
+	if (fma3) {
+		const __m256 mm = _mm256_load_ps(m);
+		__m256 acc = _mm256_fmadd_ps(_mm256_load_ps(c[2]), mm, _mm256_load_ps(c[1]));
+		acc = _mm256_fmadd_ps(acc, mm, _mm256_load_ps(c[0]));
+		acc = _mm256_mul_ps(acc, mm);
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		v = t.mmrFloatConst[cmp][pivot_idx] + _mm_cvtss_f32(sum);
+	}
+	else {
+		v = t.mmrFloatConst[cmp][pivot_idx];
+		for (int k = 0; k < 7; k++) {
+			v += ((c[2][k] * m[k] + c[1][k]) * m[k] + c[0][k]) * m[k];
+		}
+	}
+	v = v < 0.0f ? 0.0f : v;
+	v = v > 65535.0f ? 65535.0f : v;
+	return uint16_t(v);
+}
+
+uint16_t DoViProcessor::chromaMapping(const DoViFrameParams& p, const DoViDerivedTables& t, int cmp, uint16_t s0, uint16_t s1, uint16_t s2) {
+	// same as processSample, but samples beyond the BL range are allowed for the outermost table nodes
+	const uint16_t s = (cmp == 1) ? s1 : s2;
+	const int pivot_idx = getPivotIndex(p, cmp, s);
+	if (p.mapping_idc[cmp][pivot_idx] == 0) {
+		return polynompialMapping(p, cmp, pivot_idx, s);
+	}
+	return mmrMapping(p, t, cmp, pivot_idx, s0, s1, s2);
+}
+
+int16_t DoViProcessor::nonLinearInverseQuantization(const DoViFrameParams& p, int cmp, uint16_t e) {
 	// coefficients
-	int T = fp_linear_deadzone_threshold[cmp];
-	int S = fp_linear_deadzone_slope[cmp];
-	int R = fp_hdr_in_max[cmp];
+	int T = p.fp_linear_deadzone_threshold[cmp];
+	int S = p.fp_linear_deadzone_slope[cmp];
+	int R = p.fp_hdr_in_max[cmp];
 	// input data
-	int64_t rr = e - nlq_offset[cmp];
+	int64_t rr = e - p.nlq_offset[cmp];
 	int64_t r;
 	if (rr == 0) {
 		r = 0;
@@ -374,29 +858,156 @@ int16_t DoViProcessor::nonLinearInverseQuantization(int cmp, uint16_t e) const {
 		int sign = rr < 0 ? -1 : 1;
 		rr <<= 1;
 		rr -= sign;
-		rr <<= (10 - el_bit_depth);
+		rr <<= (10 - p.el_bit_depth);
 		// output data
 		int64_t dq = rr * S;
-		int64_t TT = (T << (10 - el_bit_depth + 1)) * sign;
+		int64_t TT = (T << (10 - p.el_bit_depth + 1)) * sign;
 		dq += TT;
-		int64_t RR = (R << (10 - el_bit_depth + 1));
+		int64_t RR = (R << (10 - p.el_bit_depth + 1));
 		if (dq > RR)
 			dq = RR;
 		else if (dq < -RR)
 			dq = -RR;
-		r = (dq >> (coeff_log2_denom - 5 - el_bit_depth));
+		r = (dq >> (p.coeff_log2_denom - 5 - p.el_bit_depth));
 	}
 	return r;
 }
 
 uint16_t DoViProcessor::signalReconstruction(uint16_t v, int16_t r) const {
-	int MAXOUT = (1 << out_bit_depth) - 1;
+	int MAXOUT = (1 << params.out_bit_depth) - 1;
 	int h = v;
 	if (!disable_residual_flag)
 		h += r;
-	h += (1 << (15 - out_bit_depth));
-	h >>= (16 - out_bit_depth);
+	h += (1 << (15 - params.out_bit_depth));
+	h >>= (16 - params.out_bit_depth);
 	h = h < 0 ? 0 : h;
 	h = h > MAXOUT ? MAXOUT : h;
 	return h;
 }
+
+
+void DoViProcessor::ypp2ycc(uint16_t* ycc, float y, float u, float v) {
+	static const uint16_t scale = 1 << containerBitDepth;
+	static const uint16_t bias = 16 << (containerBitDepth - 8);
+	static const uint16_t ltop = scale - (21 << (containerBitDepth - 8));
+	static const uint16_t ctop = scale - (16 << (containerBitDepth - 8));
+
+	ycc[0] = y * (ltop - bias) + bias;
+	ycc[1] = (u + 0.5) * (ctop - bias) + bias;
+	ycc[2] = (v + 0.5) * (ctop - bias) + bias;
+}
+
+bool DoViProcessor::checkElProcessing() const {
+	uint16_t yuv[3];
+	ypp2ycc(yuv, 0.5000, 0.0000, 0.0000);
+	uint16_t inGrey = yuv[0];
+	ypp2ycc(yuv, 1.0000, 0.0000, 0.0000);
+	uint16_t elHi = yuv[0];
+	ypp2ycc(yuv, 0.0000, 0.0000, 0.0000);
+	uint16_t elLo = yuv[0];
+	// the probes are generated in the container depth
+	inGrey >>= (containerBitDepth - blInputBitDepth);
+	elHi >>= (containerBitDepth - elInputBitDepth);
+	elLo >>= (containerBitDepth - elInputBitDepth);
+	uint16_t outHi = processSampleY(inGrey, elHi);
+	uint16_t outLo = processSampleY(inGrey, elLo);
+	return outHi != outLo;
+}
+
+uint16_t DoViProcessor::checkMatrix() const {
+	uint16_t yuv[3];
+	uint16_t rgb[3];
+	uint16_t diffBits = 0;
+
+	static const uint16_t maxNormRGB = 255 << (containerBitDepth - 8);
+	static const uint16_t halfNormRGB = maxNormRGB >> 1;
+
+	ypp2ycc(yuv, 1.0000, 0.0000, 0.0000);
+	sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
+	diffBits |= std::abs(rgb[0] - maxNormRGB);
+	diffBits |= std::abs(rgb[1] - maxNormRGB);
+	diffBits |= std::abs(rgb[2] - maxNormRGB);
+
+	ypp2ycc(yuv, 0.0000, 0.0000, 0.0000);
+	sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
+	diffBits |= rgb[0];
+	diffBits |= rgb[1];
+	diffBits |= rgb[2];
+
+	ypp2ycc(yuv, 0.5000, 0.0000, 0.0000);
+	sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
+	diffBits |= std::abs(rgb[0] - halfNormRGB);
+	diffBits |= std::abs(rgb[1] - halfNormRGB);
+	diffBits |= std::abs(rgb[2] - halfNormRGB);
+
+	ypp2ycc(yuv, 0.2627 / 2, -0.1396 / 2, 0.5000 / 2);
+	sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
+	diffBits |= std::abs(rgb[0] - halfNormRGB);
+	diffBits |= rgb[1];
+	diffBits |= rgb[2];
+
+	ypp2ycc(yuv, 0.6780 / 2, -0.3604 / 2, -0.4598 / 2);
+	sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
+	diffBits |= rgb[0];
+	diffBits |= std::abs(rgb[1] - halfNormRGB);
+	diffBits |= rgb[2];
+
+	ypp2ycc(yuv, 0.0593 / 2, 0.5000 / 2, -0.0402 / 2);
+	sample2rgb(rgb[0], rgb[1], rgb[2], yuv[0], yuv[1], yuv[2]);
+	diffBits |= rgb[0];
+	diffBits |= rgb[1];
+	diffBits |= std::abs(rgb[2] - halfNormRGB);
+
+	return diffBits;
+}
+
+bool DoViProcessor::checkExactIdentity() const {
+	// every possible input sample must come out unchanged in the container depth, checked on the whole mapping.
+	// the mmr depends on all three components, which cannot be tabulated, such frames are never treated as identity
+	for (int cmp = 1; cmp < 3; cmp++) {
+		for (int piece = 0; piece < params.num_pivots_minus1[cmp]; piece++) {
+			if (params.mapping_idc[cmp][piece] != 0)
+				return false;
+		}
+	}
+	const int inShift = containerBitDepth - blInputBitDepth;
+	for (int cmp = 0; cmp < 3; cmp++) {
+		const uint16_t el = getNlqOffset(cmp);
+		for (int bl = 0; bl < (1 << blInputBitDepth); bl++) {
+			if (processSample(cmp, bl, el, 0, 0, 0) != (bl << inShift))
+				return false;
+		}
+	}
+	return true;
+}
+
+uint16_t DoViProcessor::checkNonIdentityMapping() const {
+	uint16_t yuv[3];
+	uint16_t ely = getNlqOffset(0);
+	uint16_t elu = getNlqOffset(1);
+	uint16_t elv = getNlqOffset(2);
+	uint16_t diffBits = 0;
+	// the probes are generated in the container depth, which is also the depth of the output
+	const int inShift = containerBitDepth - blInputBitDepth;
+	for (int i = 0; i <= 10; i++) {
+		ypp2ycc(yuv, float(i) / 10.0, 0.0000, 0.0000);
+		uint16_t bly = yuv[0];
+		int y = processSampleY(bly >> inShift, ely);
+		diffBits |= std::abs(y - bly);
+	}
+	// the chroma mapping may depend on all three components (mmr), so sweep each chroma axis at mid grey
+	for (int i = -4; i <= 4; i++) {
+		for (int axis = 0; axis < 2; axis++) {
+			float c = float(i) / 10.0;
+			ypp2ycc(yuv, 0.5000, axis ? 0.0000 : c, axis ? c : 0.0000);
+			const uint16_t bly = yuv[0] >> inShift;
+			const uint16_t blu = yuv[1] >> inShift;
+			const uint16_t blv = yuv[2] >> inShift;
+			int u = processSampleU(blu, elu, bly, blu, blv);
+			int v = processSampleV(blv, elv, bly, blu, blv);
+			diffBits |= std::abs(u - yuv[1]);
+			diffBits |= std::abs(v - yuv[2]);
+		}
+	}
+	return diffBits;
+}
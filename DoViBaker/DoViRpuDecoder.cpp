@@ -0,0 +1,249 @@
+#include "DoViRpuDecoder.h"
+
+class RpuBitReader
+{
+public:
+	RpuBitReader(const uint8_t* _data, size_t _len) : data(_data), len(_len), pos(0) {}
+
+	uint32_t u(int n) {
+		uint64_t value = 0;
+		while (n > 0) {
+			const size_t byte = pos >> 3;
+			const int offset = pos & 7;
+			const int take = (8 - offset) < n ? (8 - offset) : n;
+			const uint8_t b = byte < len ? data[byte] : 0;
+			value = (value << take) | ((b >> (8 - offset - take)) & ((1 << take) - 1));
+			pos += take;
+			n -= take;
+		}
+		return uint32_t(value);
+	}
+	uint64_t ue() {
+		int zeros = 0;
+		while (u(1) == 0) {
+			if (++zeros > 32 || overrun()) return 0;
+		}
+		return ((1ull << zeros) - 1) + u(zeros);
+	}
+	int64_t se() {
+		uint64_t k = ue();
+		return (k & 1) ? int64_t((k + 1) >> 1) : -int64_t(k >> 1);
+	}
+	inline void skip(uint64_t n) { pos += n; }
+	inline void align() { pos = (pos + 7) & ~size_t(7); }
+	inline size_t position() const { return pos; }
+	inline bool overrun() const { return pos > len * 8; }
+
+private:
+	const uint8_t* data;
+	const size_t len;
+	size_t pos;
+};
+
+bool DoViRpuDecoder::fail(const char* message)
+{
+	error = message;
+	return false;
+}
+
+bool DoViRpuDecoder::decode(const uint8_t* nalu, size_t len, DoViFrameParams& p, DoViFrameInfo& info)
+{
+	// zero everything, such that identical rpus result in bytewise identical blocks
+	memset(&p, 0, sizeof(p));
+	memset(&info, 0, sizeof(info));
+
+	if (len < 3 || nalu[0] != 0x7C || nalu[1] != 0x01) {
+		return fail("Not an unspec62 nal unit");
+	}
+	// remove the emulation prevention bytes
+	rbsp.clear();
+	int zeros = 0;
+	for (size_t i = 2; i < len; i++) {
+		if (zeros >= 2 && nalu[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+		zeros = nalu[i] ? 0 : zeros + 1;
+		rbsp.push_back(nalu[i]);
+	}
+
+	RpuBitReader r(rbsp.data(), rbsp.size());
+	if (r.u(8) != 0x19) {
+		return fail("Invalid rpu prefix");
+	}
+	if (r.u(6) != 2) {
+		return fail("Unexpected rpu type");
+	}
+	const uint32_t rpu_format = r.u(11);
+	const uint32_t vdr_rpu_profile = r.u(4);
+	r.u(4); // vdr_rpu_level
+	if (!r.u(1)) {
+		return fail("Missing vdr sequence info");
+	}
+	r.u(1); // chroma_resampling_explicit_filter_flag
+	if (r.u(2) != 0) {
+		return fail("Only fixed point coefficients are supported");
+	}
+	const uint64_t coeff_log2_denom = r.ue();
+	if (coeff_log2_denom > 32) {
+		return fail("Unexpected coefficient_log2_denom");
+	}
+	p.coeff_log2_denom = uint8_t(coeff_log2_denom);
+	r.u(2); // vdr_rpu_normalized_idc
+	r.u(1); // bl_video_full_range_flag
+	if ((rpu_format & 0x700) != 0) {
+		return fail("Expecting profile 7 rpu data.");
+	}
+	const uint64_t bl_bit_depth_minus8 = r.ue();
+	// the bits above the low 8 carry the ext_mapping_idc, as in libdovi
+	const uint64_t el_bit_depth_minus8 = r.ue() & 0xFF;
+	const uint64_t vdr_bit_depth_minus8 = r.ue();
+	if (bl_bit_depth_minus8 > 8 || el_bit_depth_minus8 > 8 || vdr_bit_depth_minus8 > 8) {
+		return fail("Unexpected bit depth");
+	}
+	p.bl_bit_depth = uint8_t(bl_bit_depth_minus8 + 8);
+	p.el_bit_depth = uint8_t(el_bit_depth_minus8 + 8);
+	p.out_bit_depth = uint8_t(vdr_bit_depth_minus8 + 8);
+	r.u(1); // spatial_resampling_filter_flag
+	r.u(3); // reserved_zero_3bits
+	const bool el_spatial_resampling_filter_flag = r.u(1);
+	p.disable_residual_flag = r.u(1);
+
+	// profile 7 is signaled by a 12bit output with an enabled enhancement layer
+	if (vdr_rpu_profile != 1 || !el_spatial_resampling_filter_flag || p.disable_residual_flag || vdr_bit_depth_minus8 != 4) {
+		return fail("Expecting profile 7 rpu data.");
+	}
+
+	info.vdr_dm_metadata_present_flag = r.u(1);
+	if (r.u(1)) {
+		return fail("Rpus with use_prev_vdr_rpu_flag are not supported");
+	}
+	r.ue(); // vdr_rpu_id
+	r.ue(); // mapping_color_space
+	r.ue(); // mapping_chroma_format_idc
+	for (int cmp = 0; cmp < 3; cmp++) {
+		const uint64_t num_pivots_minus2 = r.ue();
+		if (num_pivots_minus2 + 1 > DoViFrameParams::maxPieces) {
+			return fail("Unexpected number of pivots.");
+		}
+		p.num_pivots_minus1[cmp] = uint8_t(num_pivots_minus2 + 1);
+		uint32_t pivot = 0;
+		for (int pivot_idx = 0; pivot_idx < p.num_pivots_minus1[cmp] + 1; pivot_idx++) {
+			pivot += r.u(p.bl_bit_depth);
+			p.pivot_value[cmp][pivot_idx] = uint16_t(pivot);
+		}
+	}
+	if (r.u(3) != 0) {
+		//https://ffmpeg.org/doxygen/trunk/dovi__rpu_8c_source.html
+		return fail("Only method NLQ_LINEAR_DZ can be applied, NLQ_MU_LAW is not documented.");
+	}
+	r.u(p.bl_bit_depth); // nlq_pred_pivot_value, nlq_num_pivots_minus2 is always 0
+	r.u(p.bl_bit_depth);
+	r.ue(); // num_x_partitions_minus1
+	r.ue(); // num_y_partitions_minus1
+
+	const int denom = p.coeff_log2_denom;
+	auto coef = [&](int64_t coef_int) { return int32_t((coef_int << denom) + r.u(denom)); };
+	for (int cmp = 0; cmp < 3; cmp++) {
+		for (int pivot_idx = 0; pivot_idx < p.num_pivots_minus1[cmp]; pivot_idx++) {
+			const uint64_t mapping_idc = r.ue();
+			if (mapping_idc > 1) {
+				return fail("Unexpected mapping_idc");
+			}
+			p.mapping_idc[cmp][pivot_idx] = uint8_t(mapping_idc);
+			if (mapping_idc == 0) {
+				const uint64_t poly_order_minus1 = r.ue();
+				if (poly_order_minus1 + 1 > DoViFrameParams::maxPolyOrder) {
+					return fail("Unexpected poly_order");
+				}
+				if (poly_order_minus1 == 0 && r.u(1)) {
+					return fail("Linear interpolation is not supported");
+				}
+				p.poly_order[cmp][pivot_idx] = uint8_t(poly_order_minus1 + 1);
+				for (int i = 0; i < p.poly_order[cmp][pivot_idx] + 1; i++) { // an order n equation has n+1 coefficients, thus +1!
+					p.fp_poly_coef[cmp][pivot_idx][i] = coef(r.se());
+				}
+			}
+			else {
+				const uint32_t mmr_order_minus1 = r.u(2);
+				if (mmr_order_minus1 + 1 > DoViFrameParams::maxMmrOrder) {
+					return fail("Unexpected mmr_order");
+				}
+				p.mmr_order[cmp][pivot_idx] = uint8_t(mmr_order_minus1 + 1);
+				p.fp_mmr_const[cmp][pivot_idx] = coef(r.se());
+				for (int i = 1; i <= p.mmr_order[cmp][pivot_idx]; i++) {
+					for (int j = 0; j < 7; j++) {
+						p.fp_mmr_coef[cmp][pivot_idx][i][j] = coef(r.se());
+					}
+				}
+			}
+		}
+	}
+
+	bool mel = true;
+	for (int cmp = 0; cmp < 3; cmp++) {
+		p.nlq_offset[cmp] = uint16_t(r.u(p.el_bit_depth));
+		const uint64_t vdr_in_max_int = r.ue();
+		const uint32_t vdr_in_max = r.u(denom);
+		const uint64_t slope_int = r.ue();
+		const uint32_t slope = r.u(denom);
+		const uint64_t threshold_int = r.ue();
+		const uint32_t threshold = r.u(denom);
+		p.fp_hdr_in_max[cmp] = uint32_t((vdr_in_max_int << denom) + vdr_in_max);
+		p.fp_linear_deadzone_slope[cmp] = uint32_t((slope_int << denom) + slope);
+		p.fp_linear_deadzone_threshold[cmp] = uint32_t((threshold_int << denom) + threshold);
+		// the minimal enhancement layer carries a residual without any effect
+		mel &= p.nlq_offset[cmp] == 0 && vdr_in_max_int == 1 && vdr_in_max == 0 && slope_int == 0 && slope == 0 && threshold_int == 0 && threshold == 0;
+	}
+	p.is_fel = !mel;
+
+	if (info.vdr_dm_metadata_present_flag) {
+		r.ue(); // affected_dm_metadata_id
+		r.ue(); // current_dm_metadata_id
+		info.scene_refresh_flag = r.ue() != 0;
+		for (int i = 0; i < 9; i++) {
+			p.ycc_to_rgb_coef[i] = int16_t(r.u(16));
+		}
+		for (int i = 0; i < 3; i++) {
+			p.ycc_to_rgb_offset[i] = r.u(32) >> (28 - 16); // scaled to the 16bit container
+		}
+		r.skip(9 * 16);   // rgb_to_lms_coef
+		r.skip(16 * 3 + 32 + 5 + 2 + 2 + 2); // signal_eotf, its parameters and the signal description
+		r.skip(12 + 12 + 10); // source_min_pq, source_max_pq, source_diagonal
+
+		const uint64_t num_ext_blocks = r.ue();
+		if (num_ext_blocks > 0) {
+			r.align();
+		}
+		for (uint64_t block = 0; block < num_ext_blocks && !r.overrun(); block++) {
+			const uint64_t ext_block_length = r.ue();
+			const uint32_t ext_block_level = r.u(8);
+			const size_t start = r.position();
+			switch (ext_block_level) {
+			case 1:
+				r.u(12); // min_pq
+				info.max_pq = uint16_t(r.u(12));
+				r.u(12); // avg_pq
+				break;
+			case 5:
+				info.active_area_left_offset = uint16_t(r.u(13));
+				info.active_area_right_offset = uint16_t(r.u(13));
+				info.active_area_top_offset = uint16_t(r.u(13));
+				info.active_area_bottom_offset = uint16_t(r.u(13));
+				break;
+			case 6:
+				r.u(16); // max_display_mastering_luminance
+				r.u(16); // min_display_mastering_luminance
+				info.max_content_light_level = uint16_t(r.u(16));
+				info.max_frame_average_light_level = uint16_t(r.u(16));
+				break;
+			}
+			r.skip(ext_block_length * 8 - (r.position() - start));
+		}
+	}
+
+	if (r.overrun()) {
+		return fail("Rpu data is truncated");
+	}
+	return true;
+}
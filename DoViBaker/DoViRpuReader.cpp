@@ -0,0 +1,82 @@
+#include "DoViRpuReader.h"
+
+DoViRpuReader::DoViRpuReader(const char* path, f_dovi_parse_unspec62_nalu _parse, f_dovi_rpu_free _free, size_t _cacheSize)
+	: dovi_parse_unspec62_nalu(_parse), dovi_rpu_free(_free), cacheSize(_cacheSize), file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL)
+{
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		error = "Cannot open rpu file";
+		return;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		error = "Rpu file is empty";
+		return;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		error = "Cannot map rpu file";
+		return;
+	}
+	view = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (view == NULL) {
+		error = "Cannot map rpu file";
+		return;
+	}
+
+	// every rpu is a nal unit behind an annex b start code, the emulation prevention guarantees that 00 00 01 does not occur inside
+	const uint64_t size = fileSize.QuadPart;
+	uint64_t naluStart = 0;
+	bool inNalu = false;
+	for (uint64_t pos = 0; pos + 3 <= size; pos++) {
+		if (view[pos + 2] > 1) {
+			pos += 2; // cannot be part of a start code up to here
+			continue;
+		}
+		if (view[pos] != 0 || view[pos + 1] != 0 || view[pos + 2] != 1)
+			continue;
+		if (inNalu) {
+			uint64_t naluEnd = pos;
+			while (naluEnd > naluStart && view[naluEnd - 1] == 0) naluEnd--; // zero byte of a four byte start code
+			index.emplace_back(naluStart, uint32_t(naluEnd - naluStart));
+		}
+		naluStart = pos + 3;
+		inNalu = true;
+		pos += 2;
+	}
+	if (inNalu && naluStart < size) {
+		index.emplace_back(naluStart, uint32_t(size - naluStart));
+	}
+	if (index.empty()) {
+		error = "No rpus found in rpu file";
+	}
+}
+
+DoViRpuReader::~DoViRpuReader()
+{
+	for (auto& entry : cache)
+		dovi_rpu_free(entry.second);
+	if (view)
+		UnmapViewOfFile(view);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+
+DoviRpuOpaque* DoViRpuReader::getRpu(int frame)
+{
+	for (auto it = cache.begin(); it != cache.end(); ++it) {
+		if (it->first == frame) {
+			cache.splice(cache.begin(), cache, it);
+			return it->second;
+		}
+	}
+	DoviRpuOpaque* rpu = dovi_parse_unspec62_nalu(view + index[frame].first, index[frame].second);
+	cache.emplace_front(frame, rpu);
+	if (cache.size() > cacheSize) {
+		dovi_rpu_free(cache.back().second);
+		cache.pop_back();
+	}
+	return rpu;
+}
@@ -0,0 +1,118 @@
+#include "DoViSidecar.h"
+
+#include <cstdio>
+
+const char DoViSidecar::magic[8] = { 'D', 'o', 'V', 'i', 'P', 'a', 'r', 'm' };
+
+bool DoViSidecar::isSidecar(const char* path)
+{
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		return false;
+	}
+	char fileMagic[sizeof(magic)];
+	bool matches = fread(fileMagic, 1, sizeof(fileMagic), fp) == sizeof(fileMagic) && memcmp(fileMagic, magic, sizeof(magic)) == 0;
+	fclose(fp);
+	return matches;
+}
+
+DoViSidecar::DoViSidecar(const char* path)
+	: file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL), header(NULL), info(NULL), params(NULL)
+{
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		error = "Cannot open sidecar file";
+		return;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(DoViSidecarHeader)) {
+		error = "Sidecar file is truncated";
+		return;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		error = "Cannot map sidecar file";
+		return;
+	}
+	view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == NULL) {
+		error = "Cannot map sidecar file";
+		return;
+	}
+
+	const uint8_t* base = static_cast<const uint8_t*>(view);
+	header = reinterpret_cast<const DoViSidecarHeader*>(base);
+	if (memcmp(header->magic, magic, sizeof(magic)) != 0) {
+		error = "Not a sidecar file";
+		return;
+	}
+	if (header->version != version || header->params_size != sizeof(DoViFrameParams) || header->info_size != sizeof(DoViFrameInfo)) {
+		error = "Sidecar file was written by a different version, recreate it with DoViAnalyzer";
+		return;
+	}
+	uint64_t infoEnd = header->info_offset + uint64_t(header->num_frames) * sizeof(DoViFrameInfo);
+	uint64_t paramsEnd = header->params_offset + uint64_t(header->num_params) * sizeof(DoViFrameParams);
+	if (infoEnd > uint64_t(fileSize.QuadPart) || paramsEnd > uint64_t(fileSize.QuadPart)) {
+		error = "Sidecar file is truncated";
+		return;
+	}
+	info = reinterpret_cast<const DoViFrameInfo*>(base + header->info_offset);
+	params = reinterpret_cast<const DoViFrameParams*>(base + header->params_offset);
+	for (uint32_t i = 0; i < header->num_frames; i++) {
+		if (info[i].params_index >= header->num_params) {
+			error = "Sidecar file is corrupt";
+			return;
+		}
+	}
+}
+
+DoViSidecar::~DoViSidecar()
+{
+	if (view)
+		UnmapViewOfFile(view);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+
+void DoViSidecarWriter::addFrame(const DoViFrameParams& frameParams, DoViFrameInfo frameInfo)
+{
+	uint64_t hash = hashFrameParams(frameParams);
+	auto range = paramsIndex.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (params[it->second] == frameParams) {
+			frameInfo.params_index = it->second;
+			info.push_back(frameInfo);
+			return;
+		}
+	}
+	frameInfo.params_index = uint32_t(params.size());
+	paramsIndex.emplace(hash, frameInfo.params_index);
+	params.push_back(frameParams);
+	info.push_back(frameInfo);
+}
+
+bool DoViSidecarWriter::write(const char* path) const
+{
+	DoViSidecarHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DoViSidecar::magic, sizeof(header.magic));
+	header.version = DoViSidecar::version;
+	header.params_size = sizeof(DoViFrameParams);
+	header.info_size = sizeof(DoViFrameInfo);
+	header.num_frames = uint32_t(info.size());
+	header.num_params = uint32_t(params.size());
+	header.info_offset = sizeof(DoViSidecarHeader);
+	header.params_offset = header.info_offset + info.size() * sizeof(DoViFrameInfo);
+
+	FILE* fp = fopen(path, "wb");
+	if (!fp) {
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(info.data(), sizeof(DoViFrameInfo), info.size(), fp) == info.size();
+	ok = ok && fwrite(params.data(), sizeof(DoViFrameParams), params.size(), fp) == params.size();
+	ok = (fclose(fp) == 0) && ok;
+	return ok;
+}
@@ -0,0 +1,96 @@
+#include "FramePrefetcher.h"
+
+#include <memory>
+#include <vector>
+
+FramePrefetcher::FramePrefetcher(PClip _clip, int _depth, std::function<bool(int)> _isNeeded)
+	: clip(_clip), depth(_depth), numFrames(_clip->GetVideoInfo().num_frames), isNeeded(_isNeeded), current(0), stop(false)
+{
+}
+
+FramePrefetcher::~FramePrefetcher()
+{
+	// the jobs still queued on the pool point to this instance, wait until all of them ran, they skip their requests now
+	std::unique_lock<std::mutex> lock(mtx);
+	stop = true;
+	workDone.wait(lock, [&]() { return inFlight.empty(); });
+}
+
+PVideoFrame FramePrefetcher::GetFrame(int n, IScriptEnvironment* _env)
+{
+	PNeoEnv neoEnv(_env);
+	IScriptEnvironment2* env2 = !neoEnv ? nullptr : static_cast<IScriptEnvironment2*>(neoEnv);
+
+	PVideoFrame frame;
+	std::vector<int> requests;
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		current = n;
+
+		// everything not ahead of the current frame is useless now, e.g. after a seek
+		for (auto it = ready.begin(); it != ready.end();) {
+			if (inWindow(it->first))
+				++it;
+			else
+				it = ready.erase(it);
+		}
+
+		if (inFlight.count(n)) {
+			workDone.wait(lock, [&]() { return inFlight.count(n) == 0; });
+		}
+		auto it = ready.find(n);
+		if (it != ready.end()) {
+			frame = it->second;
+			ready.erase(it);
+		}
+
+		for (int k = n + 1; env2 && k <= n + depth && k < numFrames; k++) {
+			if (inFlight.count(k) || ready.count(k))
+				continue;
+			if (isNeeded && !isNeeded(k))
+				continue;
+			inFlight.insert(k);
+			requests.push_back(k);
+		}
+	}
+	for (int k : requests) {
+		env2->ParallelJob(&FramePrefetcher::runJob, new Job{ this, k }, nullptr);
+	}
+
+	if (!frame) {
+		// not prefetched (first frame, seek or failed request), fall back to a synchronous request
+		frame = clip->GetFrame(n, _env);
+	}
+	return frame;
+}
+
+AVSValue FramePrefetcher::runJob(IScriptEnvironment2* env, void* data)
+{
+	std::unique_ptr<Job> job(static_cast<Job*>(data));
+	FramePrefetcher* self = job->self;
+
+	bool wanted;
+	{
+		std::lock_guard<std::mutex> lock(self->mtx);
+		wanted = self->inWindow(job->k);
+	}
+
+	PVideoFrame frame;
+	if (wanted) {
+		try {
+			frame = self->clip->GetFrame(job->k, env);
+		}
+		catch (...) {
+			// the frame will be requested again synchronously, which then reports the error properly
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(self->mtx);
+	self->inFlight.erase(job->k);
+	if (frame && self->inWindow(job->k)) {
+		self->ready[job->k] = frame;
+	}
+	// notify while holding the lock, the destructor may release the instance right after
+	self->workDone.notify_all();
+	return AVSValue();
+}
@@ -0,0 +1,60 @@
+#include "ScratchArena.h"
+
+#include <malloc.h>
+#include <new>
+
+ScratchArena::ScratchArena()
+	: block(nullptr), capacity(0), used(0), peak(0)
+{
+}
+
+ScratchArena::~ScratchArena()
+{
+	release(0);
+	_aligned_free(block);
+}
+
+ScratchArena& ScratchArena::local()
+{
+	static thread_local ScratchArena arena;
+	return arena;
+}
+
+void* ScratchArena::allocate(size_t bytes)
+{
+	bytes = (bytes + alignment - 1) & ~(alignment - 1);
+	void* ptr;
+	if (used + bytes <= capacity) {
+		ptr = block + used;
+	}
+	else {
+		ptr = _aligned_malloc(bytes, alignment);
+		if (!ptr)
+			throw std::bad_alloc{};
+		overflow.push_back({ used, ptr });
+	}
+	used += bytes;
+	peak = (used > peak) ? used : peak;
+	return ptr;
+}
+
+void ScratchArena::release(size_t mark)
+{
+	while (!overflow.empty() && overflow.back().mark >= mark) {
+		_aligned_free(overflow.back().ptr);
+		overflow.pop_back();
+	}
+	used = mark;
+
+	if (used == 0 && peak > capacity) {
+		// grown in steps of 1MB, such that a slightly larger frame does not cause another reallocation
+		const size_t step = 1 << 20;
+		const size_t newCapacity = (peak + step - 1) & ~(step - 1);
+		uint8_t* newBlock = static_cast<uint8_t*>(_aligned_malloc(newCapacity, alignment));
+		if (newBlock) {
+			_aligned_free(block);
+			block = newBlock;
+			capacity = newCapacity;
+		}
+	}
+}
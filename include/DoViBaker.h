@@ -4,7 +4,9 @@
 #include "avisynth.h"
 #pragma warning(pop)
 
+#include "DoViFilters.h"
 #include "DoViProcessor.h"
+#include "FramePrefetcher.h"
 #include "lut.h"
 
 #include <string>
@@ -20,10 +22,18 @@ public:
     bool blClipChromaSubSampled, 
     bool elClipChromaSubSampled, 
     std::vector<std::pair<uint16_t, std::string>> &cubes, 
-    bool qnd, 
+    int quality, 
     bool rgbProof, 
     bool nlqProof,
     bool outYUV,
+    int prefetch,
+    bool nativeRpu,
+    int outputDepth,
+    bool outYUV420,
+    bool downscale,
+    UpsampleFilter upsampleFilter,
+    bool approxMmr,
+    bool mmrTable,
     IScriptEnvironment* env);
   virtual ~DoViBaker();
   PVideoFrame GetFrame(int n, IScriptEnvironment* env) override;
@@ -31,31 +41,86 @@ public:
 private:
   void upscaleEl(PVideoFrame& dst, const PVideoFrame& el, VideoInfo dstVi, IScriptEnvironment* env);
   void upsampleChroma(PVideoFrame& dst, const PVideoFrame& el, VideoInfo dstVi, IScriptEnvironment* env);
+  template<class Kernel>
+  void upscaleEl(PVideoFrame& dst, const PVideoFrame& el, VideoInfo dstVi, IScriptEnvironment* env);
+  template<class Kernel>
+  void upsampleChroma(PVideoFrame& dst, const PVideoFrame& el, VideoInfo dstVi, IScriptEnvironment* env);
   //void upsampleElChroma(PVideoFrame& dst, const PVideoFrame& el, VideoInfo dstVi, IScriptEnvironment* env);
   //void upsampleBlChroma(PVideoFrame& dst, const PVideoFrame& el, VideoInfo dstVi, IScriptEnvironment* env);
 
-  template<int blChromaSubsampling, int elChromaSubsampling>
-  void doAllQuickAndDirty(PVideoFrame& rgb, const PVideoFrame& blSrc, const PVideoFrame& elSrc, IScriptEnvironment* env) const;
+  template<int blChromaSubsampling, int elChromaSubsampling, int elQuarterResolution>
+  void doAllQuickAndDirty(PVideoFrame& rgb, const PVideoFrame& blSrc, const PVideoFrame& elSrc, bool finalStore, IScriptEnvironment* env) const;
+  template<int blChromaSubsampling, int elChromaSubsampling, int elQuarterResolution>
+  void doAllBilinear(PVideoFrame& rgb, const PVideoFrame& blSrc, const PVideoFrame& elSrc, bool finalStore, IScriptEnvironment* env) const;
+  template<int bilinear>
+  void doAllInline(PVideoFrame& rgb, const PVideoFrame& blSrc, const PVideoFrame& elSrc, bool skipElProcessing, bool finalStore, IScriptEnvironment* env) const;
+
+  // rectangle in luma samples, right and bottom are exclusive
+  struct Area
+  {
+    int left;
+    int top;
+    int right;
+    int bottom;
+  };
 
   template<int chromaSubsampling>
-  void applyDovi(PVideoFrame& dst, const PVideoFrame& blSrcY, const PVideoFrame& blSrcUV, const PVideoFrame& elSrcY, const PVideoFrame& elSrcUV, IScriptEnvironment* env) const;
-  void convert2rgb(PVideoFrame& rgb, const PVideoFrame& y, const PVideoFrame& uv) const;
-  void applyLut(PVideoFrame& dst, const PVideoFrame& src) const;
-
-  typedef uint16_t(*upscaler_t)(const uint16_t* srcSamples, int idx0);
-  template<int vertLen, int nD>
-  void upsampleVert(PVideoFrame& dst, const PVideoFrame& src, int plane, const std::array<int, vertLen>& Dn0p, const upscaler_t evenUpscaler, const upscaler_t oddUpscaler, IScriptEnvironment* env);
-  template<int vertLen, int nD>
-  void upsampleHorz(PVideoFrame& dst, const PVideoFrame& src, int plane, const std::array<int, vertLen>& Dn0p, const upscaler_t evenUpscaler, const upscaler_t oddUpscaler, IScriptEnvironment* env);
+  void applyDovi(PVideoFrame& dst, const PVideoFrame& blSrcY, const PVideoFrame& blSrcUV, const PVideoFrame& elSrcY, const PVideoFrame& elSrcUV, const Area& area, bool finalStore, IScriptEnvironment* env) const;
+  void composeYUV420(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, const Area& area) const;
+  template<class Kernel>
+  void composeYUV420(PVideoFrame& dst, const PVideoFrame& blSrc, const PVideoFrame& elSrc, const Area& area) const;
+  int findFlatElTiles(const PVideoFrame& el);
+  void downsampleLuma(uint16_t* dst, int dstPitch, const PVideoFrame& src, int huvBegin, int huvEnd, bool repeatLastColumn) const;
+  void downscaleBl(PVideoFrame& dst, const PVideoFrame& src) const;
+  void widenBl(PVideoFrame& dst, const PVideoFrame& src) const;
+  void convert2rgb(PVideoFrame& rgb, const PVideoFrame& y, const PVideoFrame& uv, const Area& area, bool finalStore) const;
+  void applyLut(PVideoFrame& dst, const PVideoFrame& src, const Area& area) const;
+  void convert2yuv420(PVideoFrame& dst, const PVideoFrame& y, const PVideoFrame& uv, const Area& area, bool applyCube) const;
+  inline void rgb2yuv(float* yuv, const float* rgb) const;
+  PVideoFrame finishYUV(PVideoFrame& dst, const PVideoFrame& blSrc, bool hasBars, int barX, int barY, bool chromaSubSampled, IScriptEnvironment* env) const;
+  PVideoFrame finishYUV420(PVideoFrame& dst, const PVideoFrame& y, const PVideoFrame& uv, const PVideoFrame& blSrc, bool applyCube, bool hasBars, int barX, int barY) const;
+  void convert2rgbFloat(PVideoFrame& dst, const PVideoFrame& y, const PVideoFrame& uv, const Area& area, bool applyCube) const;
+  PVideoFrame finishFloat(PVideoFrame& dst, const PVideoFrame& y, const PVideoFrame& uv, const PVideoFrame& blSrc, bool applyCube, bool hasBars, int barX, int barY) const;
+  bool findActiveArea();
+  void composeBarColor(uint16_t* yuv, const PVideoFrame& blSrc, int x, int y) const;
+  inline uint16_t ditherSample(uint16_t sample, int x, int y) const;
+  void ditherRow(uint16_t* row, int begin, int end, int y) const;
+  inline uint16_t reduceDepth(uint16_t sample) const;
+  template<typename T>
+  void fillBars(PVideoFrame& dst, const int* planes, const T* color, int chromaShift) const;
+
+  template<class Upsampler>
+  void upsample2x(PVideoFrame& dst, const PVideoFrame& src, int plane, const uint8_t* skipTiles = nullptr, int tileShift = 0, uint16_t flatValue = 0);
   //void upsampleHorz(PVideoFrame& dst, const PVideoFrame& src, int plane, IScriptEnvironment* env);
 
   PClip elChild;
+  VideoInfo containerVi; // the BL format in the 16bit container, used for all intermediate frames
+  int blInputBitDepth;
+  std::unique_ptr<FramePrefetcher> blPrefetcher;
+  std::unique_ptr<FramePrefetcher> elPrefetcher;
   int CPU_FLAG;
+  bool has_at_least_v9;
   DoViProcessor* doviProc;
-  const bool qnd;
+  const int quality; // 0 nearest neighbour and 1 bilinear, both composed in a single pass, 2 spline16 upsampling in separate passes
   const bool outYUV;
+  const bool outYUV420; // the RGB output after the luts converted to BT.2020 ncl limited range YUV420
+  const bool downscale; // the BL is halved in size, such that everything runs at the resolution of the EL
+  const UpsampleFilter upsampleFilter; // kernel of the separate upsampling passes of the full quality path
+  const int outputDepth; // the samples are computed in 16bit and dithered down when they are stored, 32 is float RGB
   const bool blClipChromaSubSampled;
   const bool elClipChromaSubSampled;
   std::vector<std::pair<uint16_t, std::unique_ptr<timecube::Lut>>> luts;
+  std::vector<uint16_t> lutIdentityKnees; // highest max_pq for which each lut can be skipped
   const timecube::Lut* current_frame_lut;
+
+  // active area of the current frame signalled by L5, and the slightly larger area which is composed
+  Area activeArea;
+  Area composeArea;
+
+  // residual map of the current EL frame in tiles of 16x16 EL luma samples
+  static const int elTileShift = 4;
+  int elTileCols;
+  int elTileRows;
+  std::vector<uint8_t> elTileFlat;
+  std::vector<uint8_t> elTileSkip;
 };
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/*
+*  resampling kernels as used by the avisynth resizers, the fixed point taps of the upsamplers are generated from them at compile time
+*/
+
+enum class UpsampleFilter {
+  BILINEAR,
+  SPLINE16,
+  SPLINE16_EXACT,
+  SPLINE36,
+};
+
+constexpr double BilinearFilter(double value) {
+  value = (value < 0) ? -value : value;
+
+  if (value < 1.0) {
+    return 1.0 - value;
+  }
+  return 0.0;
+}
+
+constexpr double Spline16Filter(double value) {
+  value = (value < 0) ? -value : value;
+
+  if (value < 1.0) {
+    return ((value - 9.0 / 5.0) * value - 1.0 / 5.0) * value + 1.0;
+  }
+  else if (value < 2.0) {
+    return ((-1.0 / 3.0 * (value - 1.0) + 4.0 / 5.0) * (value - 1.0) - 7.0 / 15.0) * (value - 1.0);
+  }
+  return 0.0;
+}
+
+constexpr double Spline36Filter(double value) {
+  value = (value < 0) ? -value : value;
+
+  if (value < 1.0) {
+    return ((13.0 / 11.0 * (value)-453.0 / 209.0) * (value)-3.0 / 209.0) * (value)+1.0;
+  }
+  else if (value < 2.0) {
+    return ((-6.0 / 11.0 * (value - 1.0) + 270.0 / 209.0) * (value - 1.0) - 156.0 / 209.0) * (value - 1.0);
+  }
+  else if (value < 3.0) {
+    return  ((1.0 / 11.0 * (value - 2.0) - 45.0 / 209.0) * (value - 2.0) + 26.0 / 209.0) * (value - 2.0);
+  }
+  return 0.0;
+}
+
+constexpr double Spline64Filter(double value) {
+  value = (value < 0) ? -value : value;
+
+  if (value < 1.0) {
+    return ((49.0 / 41.0 * (value)-6387.0 / 2911.0) * (value)-3.0 / 2911.0) * (value)+1.0;
+  }
+  else if (value < 2.0) {
+    return ((-24.0 / 41.0 * (value - 1.0) + 4032.0 / 2911.0) * (value - 1.0) - 2328.0 / 2911.0) * (value - 1.0);
+  }
+  else if (value < 3.0) {
+    return ((6.0 / 41.0 * (value - 2.0) - 1008.0 / 2911.0) * (value - 2.0) + 582.0 / 2911.0) * (value - 2.0);
+  }
+  else if (value < 4.0) {
+    return ((-1.0 / 41.0 * (value - 3.0) + 168.0 / 2911.0) * (value - 3.0) - 97.0 / 2911.0) * (value - 3.0);
+  }
+  return 0.0;
+}
+
+/*
+*  a kernel with tabulated luma taps uses the given window of 5 taps for the center sited luma instead of generating it
+*/
+struct BilinearKernel {
+  static constexpr int radius = 1;
+  static constexpr double weight(double x) { return BilinearFilter(x); }
+  static constexpr bool tabulatedLuma = false;
+};
+
+// the default spline16, its luma keeps the hand-tuned taps (-3, 29, 111, -9) / 128 of earlier versions such that their output does not change
+struct Spline16Kernel {
+  static constexpr int radius = 2;
+  static constexpr double weight(double x) { return Spline16Filter(x); }
+  static constexpr bool tabulatedLuma = true;
+  static constexpr std::array<int, 5> lumaEvenTaps = { -96, 928, 3552, -288, 0 }; // scaled to 12bit
+  static constexpr std::array<int, 5> lumaOddTaps = { 0, -288, 3552, 928, -96 };
+};
+
+// spline16 with the luma taps generated from the exact weights as well
+struct Spline16ExactKernel {
+  static constexpr int radius = 2;
+  static constexpr double weight(double x) { return Spline16Filter(x); }
+  static constexpr bool tabulatedLuma = false;
+};
+
+struct Spline36Kernel {
+  static constexpr int radius = 3;
+  static constexpr double weight(double x) { return Spline36Filter(x); }
+  static constexpr bool tabulatedLuma = false;
+};
+
+/*
+*  upsampling by two, the even output samples lie evenPhase quarter samples after source sample n and the odd ones half a sample further
+*  the taps of both phases share one window of len source samples starting nD samples before n
+*/
+template<class Kernel, int evenPhase>
+struct Upsampler
+{
+  static constexpr int shift = 12;
+
+  static constexpr int floorDiv4(int v) { return (v >= 0) ? v / 4 : -((-v + 3) / 4); }
+  // first and last source sample within the support of the kernel
+  static constexpr int firstTap(int phase) { return floorDiv4(phase - 4 * Kernel::radius) + 1; }
+  static constexpr int lastTap(int phase) { return -floorDiv4(-(phase + 4 * Kernel::radius)) - 1; }
+
+  static constexpr int nD = -((firstTap(evenPhase) < firstTap(evenPhase + 2)) ? firstTap(evenPhase) : firstTap(evenPhase + 2));
+  static constexpr int len = nD + 1 + ((lastTap(evenPhase) > lastTap(evenPhase + 2)) ? lastTap(evenPhase) : lastTap(evenPhase + 2));
+
+  static constexpr std::array<int, len> makeTaps(int phase) {
+    if constexpr (Kernel::tabulatedLuma && evenPhase == -1) {
+      static_assert(len == 5 && nD == 2, "the tabulated luma taps cover the window -2..2");
+      return (phase == evenPhase) ? Kernel::lumaEvenTaps : Kernel::lumaOddTaps;
+    }
+    std::array<int, len> taps = {};
+    int sum = 0;
+    int largest = 0;
+    for (int i = 0; i < len; i++) {
+      const double w = Kernel::weight(i - nD - phase / 4.0) * (1 << shift);
+      taps[i] = int(w >= 0 ? w + 0.5 : w - 0.5);
+      sum += taps[i];
+      largest = (taps[i] > taps[largest]) ? i : largest;
+    }
+    // a constant input must stay constant, the rounding error goes to the largest tap
+    taps[largest] += (1 << shift) - sum;
+    return taps;
+  }
+
+  static constexpr std::array<int, len> makeOffsets() {
+    std::array<int, len> offsets = {};
+    for (int i = 0; i < len; i++) {
+      offsets[i] = i - nD;
+    }
+    return offsets;
+  }
+
+  static constexpr std::array<int, len> evenTaps = makeTaps(evenPhase);
+  static constexpr std::array<int, len> oddTaps = makeTaps(evenPhase + 2);
+  static constexpr std::array<int, len> offsets = makeOffsets();
+
+  static inline uint16_t apply(const std::array<int, len>& taps, const uint16_t* samples) {
+    int val = 1 << (shift - 1);
+    for (int i = 0; i < len; i++) {
+      val += taps[i] * samples[i];
+    }
+    val >>= shift;
+    return (val < 0) ? 0 : ((val > 0xFFFF) ? 0xFFFF : val);
+  }
+
+  static inline uint16_t upsampleEven(const uint16_t* srcSamples, int idx0) { return apply(evenTaps, srcSamples + idx0 - nD); }
+  static inline uint16_t upsampleOdd(const uint16_t* srcSamples, int idx0) { return apply(oddTaps, srcSamples + idx0 - nD); }
+};
+
+// the EL luma is center sited, the upsampled samples lie a quarter sample before and after the source samples
+template<class Kernel>
+using LumaUpsampler = Upsampler<Kernel, -1>;
+
+// the chroma is top left sited, the even samples are co-sited and the odd ones lie halfway
+template<class Kernel>
+using ChromaUpsampler = Upsampler<Kernel, 0>;
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/*
+* fully decoded composer parameters of one rpu, converted to fixed point.
+* the layout is flat and free of pointers and padding, such that it can be hashed, compared and stored in a file as is.
+*/
+struct DoViFrameParams
+{
+  static const int maxPieces = 8;         // num_pivots_minus2 is at most 7
+  static const int maxPivots = maxPieces + 1;
+  static const int maxPolyOrder = 2;
+  static const int maxMmrOrder = 3;
+
+  int32_t fp_mmr_coef[3][maxPieces][maxMmrOrder + 1][7]; // index 0 of the order is unused, the constant is separate
+  int32_t fp_poly_coef[3][maxPieces][maxPolyOrder + 1];
+  int32_t fp_mmr_const[3][maxPieces];
+
+  uint32_t fp_hdr_in_max[3];
+  uint32_t fp_linear_deadzone_slope[3];
+  uint32_t fp_linear_deadzone_threshold[3];
+  uint32_t ycc_to_rgb_offset[3];
+  int16_t ycc_to_rgb_coef[9];
+
+  uint16_t pivot_value[3][maxPivots];
+  uint16_t nlq_offset[3];
+
+  uint8_t mapping_idc[3][maxPieces];
+  uint8_t poly_order[3][maxPieces];
+  uint8_t mmr_order[3][maxPieces];
+  uint8_t num_pivots_minus1[3];
+
+  uint8_t bl_bit_depth;
+  uint8_t el_bit_depth;
+  uint8_t out_bit_depth;
+  uint8_t coeff_log2_denom;
+  uint8_t is_fel;
+  uint8_t disable_residual_flag;
+  uint8_t reserved;
+};
+static_assert(sizeof(DoViFrameParams) % 4 == 0, "DoViFrameParams must not need tail padding");
+
+/*
+* the per frame dynamic part of the rpu, which changes even when the composer parameters stay the same
+*/
+struct DoViFrameInfo
+{
+  uint32_t params_index;
+  uint16_t max_pq;                        // level 1
+  uint8_t scene_refresh_flag;
+  uint8_t vdr_dm_metadata_present_flag;
+  uint16_t active_area_left_offset;       // level 5
+  uint16_t active_area_right_offset;
+  uint16_t active_area_top_offset;
+  uint16_t active_area_bottom_offset;
+  uint16_t max_content_light_level;       // level 6
+  uint16_t max_frame_average_light_level;
+};
+static_assert(sizeof(DoViFrameInfo) == 20, "DoViFrameInfo must not need padding");
+
+// FNV-1a over the raw bytes, the parameter blocks are always zero initialized before being filled
+inline uint64_t hashFrameParams(const DoViFrameParams& params)
+{
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(&params);
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < sizeof(DoViFrameParams); i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+inline bool operator==(const DoViFrameParams& lhs, const DoViFrameParams& rhs)
+{
+  return memcmp(&lhs, &rhs, sizeof(DoViFrameParams)) == 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "DoViFrameParams.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/*
+* decodes the rpus of the frames following the current one on a background thread,
+* the prepare callback may additionally build everything derived from the decoded parameters.
+* on random access nothing is prepared in time and the caller falls back to decoding synchronously.
+*/
+class DoViLookahead
+{
+public:
+  typedef std::function<bool(int, DoViFrameParams&, DoViFrameInfo&)> prepare_t;
+
+  DoViLookahead(int _numFrames, int _depth, prepare_t _prepare);
+  virtual ~DoViLookahead();
+
+  // hands out frame n if it was prepared and schedules the following frames
+  bool take(int n, DoViFrameParams& params, DoViFrameInfo& info);
+
+private:
+  struct PreparedFrame
+  {
+    DoViFrameParams params;
+    DoViFrameInfo info;
+  };
+
+  void worker();
+  inline bool inWindow(int k, int n) const { return k >= n && k <= n + depth; }
+
+  const int numFrames;
+  const int depth;
+  const prepare_t prepare;
+
+  std::thread thread;
+  std::mutex mtx;
+  std::condition_variable workAvailable;
+  std::condition_variable workDone;
+
+  std::deque<int> queue;
+  std::map<int, std::unique_ptr<PreparedFrame>> ready;
+  int current;
+  int inFlight;
+  bool stop;
+};
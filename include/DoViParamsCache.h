@@ -0,0 +1,61 @@
+#pragma once
+
+#include "DoViFrameParams.h"
+#include "lut.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+* tables derived from one unique parameter block, these replace the per sample evaluation of the mapping functions.
+* the luma and polynomial chroma mapping as well as the nlq only depend on a single sample and are fully tabulated,
+* for mmr mapped pieces only the coefficients are packed in evaluation order.
+* with the approximate mmr evaluation they are also kept as float, grouped by term such that each order is one vector of 8 lanes.
+* the optional chroma table samples the complete chroma mapping on a 3D grid of the BL samples and is interpolated trilinearly.
+*/
+struct DoViDerivedTables
+{
+  DoViFrameParams params; // the unmodified block, used as the key
+  std::vector<uint16_t> mappingLut[3];
+  std::vector<uint8_t> pieceLut[3];
+  std::vector<int16_t> nlqLut[3];
+  int32_t mmrPacked[3][DoViFrameParams::maxPieces][1 + 7 * DoViFrameParams::maxMmrOrder];
+  alignas(32) float mmrFloat[3][DoViFrameParams::maxPieces][DoViFrameParams::maxMmrOrder][8]; // scaled to the 16bit output, the last lane is zero
+  float mmrFloatConst[3][DoViFrameParams::maxPieces];
+  bool mmrApprox[3][DoViFrameParams::maxPieces]; // the float evaluation stays within 1 LSB of the fixed point one
+  std::unique_ptr<timecube::Lut> chromaLut; // (Y, U, V) to the mapped (U, V), only set when it stays within 1 LSB everywhere
+  bool identity_checked; // only accessed by the thread composing the frames
+  bool identity_mapping;
+};
+
+/*
+* interns parameter blocks by content hash, within a scene most frames carry the exact same block.
+* every entry remembers the last frame it was used for, a scene refresh drops the entries of all earlier frames.
+* the size is limited, such that memory stays bounded on long titles. all functions are thread safe.
+*/
+class DoViParamsCache
+{
+public:
+  DoViParamsCache(size_t _maxEntries = 32);
+
+  std::shared_ptr<DoViDerivedTables> find(const DoViFrameParams& params, uint64_t hash, int frame);
+  void insert(uint64_t hash, std::shared_ptr<DoViDerivedTables> tables, int frame);
+  void newScene(int frame);
+
+private:
+  struct Entry
+  {
+    uint64_t hash;
+    int lastFrame;
+    std::shared_ptr<DoViDerivedTables> tables;
+  };
+  typedef std::list<Entry> lru_t;
+  void erase(lru_t::iterator entry);
+
+  const size_t maxEntries;
+  std::mutex mtx;
+  lru_t lru; // most recently used first
+  std::unordered_multimap<uint64_t, lru_t::iterator> index;
+};
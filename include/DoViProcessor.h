@@ -5,11 +5,18 @@
 #pragma warning(pop)
 
 #include "rpu_parser.h"
+#include "DoViFrameParams.h"
+#include "DoViLookahead.h"
+#include "DoViParamsCache.h"
+#include "DoViRpuDecoder.h"
+#include "DoViRpuReader.h"
+#include "DoViSidecar.h"
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <windows.h>
 
-typedef DoviRpuOpaqueList* (*f_dovi_parse_rpu_bin_file)(const char* path);
-typedef void (*f_dovi_rpu_list_free)(DoviRpuOpaqueList* ptr);
 typedef const char* (*f_dovi_rpu_get_error)(const DoviRpuOpaque* ptr);
 typedef const DoviRpuDataHeader* (*f_dovi_rpu_get_header)(const DoviRpuOpaque* ptr);
 typedef void (*f_dovi_rpu_free_header)(const DoviRpuDataHeader* ptr);
@@ -22,31 +29,50 @@ typedef void (*f_dovi_rpu_free_vdr_dm_data)(const DoviVdrDmData* ptr);
 
 class DoViProcessor {
 public:
-  DoViProcessor(const char* rpuPath, IScriptEnvironment* env);
+  DoViProcessor(const char* rpuPath, IScriptEnvironment* env, bool nativeDecoder = false);
   virtual ~DoViProcessor();
   bool wasCreationSuccessful() { return successfulCreation; }
   void setRgbProof(bool set = true) { rgbProof = set; }
   void setNlqProof(bool set = true) { nlqProof = set; }
+  void setApproxMmr(bool set = true) { approxMmr = set; }
+  void setChromaTable(bool set = true) { chromaTable = set; }
+  void setInputBitDepth(uint16_t bl, uint16_t el) { blInputBitDepth = bl; elInputBitDepth = el; }
+  void enableLookahead(int depth);
 
   bool intializeFrame(int frame, IScriptEnvironment* env);
-  inline int getClipLength() { return rpus->len; }
-  inline bool isFEL() const { return is_fel; }
+  bool decodeFrame(int frame, DoViFrameParams& p, DoViFrameInfo& info, IScriptEnvironment* env);
+  bool requiresElProcessing(int frame) const;
+  inline int getClipLength() { return sidecar ? sidecar->getClipLength() : reader->getLength(); }
+  inline bool isFEL() const { return params.is_fel; }
   inline bool isSceneChange() { return scene_refresh_flag; }
   inline bool elProcessingDisabled() { return disable_residual_flag; }
   inline void forceDisableElProcessing(bool force = true) { disable_residual_flag = force; }
-  inline uint16_t getNlqOffset(int cmp) const { return nlq_offset[cmp] << (containerBitDepth - el_bit_depth); }
+  inline uint16_t getNlqOffset(int cmp) const { return params.nlq_offset[cmp] << (elInputBitDepth - params.el_bit_depth); }
   inline uint16_t getMaxPq() const { return max_pq; }
   inline uint16_t getMaxContentLightLevel() const { return max_content_light_level; }
+  inline uint16_t getActiveAreaLeftOffset() const { return active_area_left_offset; }
+  inline uint16_t getActiveAreaRightOffset() const { return active_area_right_offset; }
+  inline uint16_t getActiveAreaTopOffset() const { return active_area_top_offset; }
+  inline uint16_t getActiveAreaBottomOffset() const { return active_area_bottom_offset; }
+  inline bool isIdentityMapping() const { return identity_mapping; }
+  inline bool isStandardMatrix() const { return standard_matrix; }
 
-  static inline uint16_t pq2nits(uint16_t pq);
+  /*
+  * the decoded parameters of the current frame as they are stored in a sidecar, without any proof modifications
+  */
+  inline const DoViFrameParams& getFrameParams() const { return *currentParams; }
+  inline const DoViFrameInfo& getFrameInfo() const { return currentInfo; }
 
   /*
-  * these upsampling functions are not following the paper, but should be correct when assuming top-left chroma location
+  * probes of the current frame, the returned bits show the maximal deviation from the identity / standard BT.2020 matrix
   */
-  static inline constexpr uint16_t upsampleLumaEven(const uint16_t* srcSamples, int idx0);
-  static inline constexpr uint16_t upsampleLumaOdd(const uint16_t* srcSamples, int idx0);
-  static inline constexpr uint16_t upsampleChromaEven(const uint16_t* srcSamples, int idx0);
-  static inline constexpr uint16_t upsampleChromaOdd(const uint16_t* srcSamples, int idx0);
+  bool checkElProcessing() const;
+  uint16_t checkMatrix() const;
+  uint16_t checkNonIdentityMapping() const;
+
+  static inline uint16_t pq2nits(uint16_t pq);
+
+  // the upsampling kernels are generated in DoViFilters.h
 
   /*
   * these are the original upsampling functions from the paper and seem to assume center-left chroma location which is actually incorrect for hdr sources
@@ -64,24 +90,53 @@ public:
   inline uint16_t processSampleU(uint16_t bl, uint16_t el, uint16_t mmrBlY, uint16_t mmrBlU, uint16_t mmrBlV) const;
   inline uint16_t processSampleV(uint16_t bl, uint16_t el, uint16_t mmrBlY, uint16_t mmrBlU, uint16_t mmrBlV) const;
 
+  /*
+  * maps a row of BL chroma through the chroma table of the current frame, the results are passed to processMappedSampleU/V.
+  * returns false when the frame has no chroma table, the samples must then be processed with processSampleU/V.
+  */
+  bool mapChromaRow(uint16_t* mappedU, uint16_t* mappedV, const uint16_t* mmrBlY, const uint16_t* blU, const uint16_t* blV, int width) const;
+  inline uint16_t processMappedSampleU(uint16_t mapped, uint16_t el) const;
+  inline uint16_t processMappedSampleV(uint16_t mapped, uint16_t el) const;
+
   inline void sample2rgb(uint16_t& r, uint16_t& g, uint16_t& b, const uint16_t& y, const uint16_t& u, const uint16_t& v) const;
+  // same matrix, normalized to [0,1] without clipping or quantization of the result
+  inline void sample2rgbFloat(float& r, float& g, float& b, const uint16_t& y, const uint16_t& u, const uint16_t& v) const;
+  // converts a row, the chroma samples are repeated 1 << chromaShift times
+  void sample2rgbRow(uint16_t* r, uint16_t* g, uint16_t* b, const uint16_t* y, const uint16_t* u, const uint16_t* v, int width, int chromaShift) const;
 
   static const uint16_t containerBitDepth = 16;
 private:
   static inline constexpr uint16_t Clip3(uint16_t lower, uint16_t upper, int value);
   void showMessage(const char* message, IScriptEnvironment* env);
+  static bool isFelSubprofile(const char* subprofile);
+  bool checkExactIdentity() const;
+  bool decodeRpu(int frame, DoViFrameParams& p, DoViFrameInfo& info, std::string& error) const;
+  bool prepareFrame(int frame, DoViFrameParams& p, DoViFrameInfo& info);
+  std::shared_ptr<DoViDerivedTables> compileTables(const DoViFrameParams& p, int frame);
+  static void buildTables(DoViDerivedTables& t, const DoViFrameParams& p);
+  void buildMmrApproximation(DoViDerivedTables& t, const DoViFrameParams& p) const;
+  static void buildChromaTable(DoViDerivedTables& t, const DoViFrameParams& p);
+  static void ypp2ycc(uint16_t* ycc, float y, float u, float v);
   uint16_t processSample(int cmp, uint16_t bl, uint16_t el, uint16_t mmrBlY, uint16_t mmrBlU, uint16_t mmrBlV) const;
-  int getPivotIndex(int cmp, uint16_t sample) const;
-  uint16_t polynompialMapping(int cmp, int pivot_idx, uint16_t sample) const;
-  uint16_t mmrMapping(int cmp, int pivot_idx, uint16_t sampleY, uint16_t sampleU, uint16_t sampleV) const;
-  int16_t nonLinearInverseQuantization(int cmp, uint16_t sample) const;
+  uint16_t processMappedSample(int cmp, int v, uint16_t el) const;
+  static int getPivotIndex(const DoViFrameParams& p, int cmp, uint16_t sample);
+  static uint16_t polynompialMapping(const DoViFrameParams& p, int cmp, int pivot_idx, uint16_t sample);
+  static void clipMmrInputs(const DoViFrameParams& p, uint16_t& sampleY, uint16_t& sampleU, uint16_t& sampleV);
+  static uint16_t mmrMapping(const DoViFrameParams& p, const DoViDerivedTables& t, int cmp, int pivot_idx, uint16_t sampleY, uint16_t sampleU, uint16_t sampleV);
+  static uint16_t chromaMapping(const DoViFrameParams& p, const DoViDerivedTables& t, int cmp, uint16_t sampleY, uint16_t sampleU, uint16_t sampleV);
+  uint16_t mmrMappingFloat(const DoViFrameParams& p, const DoViDerivedTables& t, int cmp, int pivot_idx, uint16_t sampleY, uint16_t sampleU, uint16_t sampleV) const;
+  static int16_t nonLinearInverseQuantization(const DoViFrameParams& p, int cmp, uint16_t sample);
   uint16_t signalReconstruction(uint16_t v, int16_t r) const;
 
   HINSTANCE doviLib;
-  DoviRpuOpaqueList* rpus;
-
-  f_dovi_parse_rpu_bin_file dovi_parse_rpu_bin_file;
-  f_dovi_rpu_list_free dovi_rpu_list_free;
+  std::unique_ptr<DoViRpuReader> reader;
+  std::unique_ptr<DoViRpuDecoder> rpuDecoder; // in-tree decoder instead of libdovi
+  std::unique_ptr<DoViLookahead> lookahead;
+  mutable std::mutex decodeMutex;
+  std::unique_ptr<DoViSidecar> sidecar;
+
+  f_dovi_parse_unspec62_nalu dovi_parse_unspec62_nalu;
+  f_dovi_rpu_free dovi_rpu_free;
   f_dovi_rpu_get_header dovi_rpu_get_header;
   f_dovi_rpu_free_header dovi_rpu_free_header;
   f_dovi_rpu_get_data_nlq dovi_rpu_get_data_nlq;
@@ -93,41 +148,39 @@ private:
   f_dovi_rpu_get_error dovi_rpu_get_error;
 
   bool successfulCreation;
+  bool sse41;
+  bool fma3;
   bool rgbProof;
   bool nlqProof;
+  bool approxMmr; // mmr pieces are evaluated in float where the result stays within 1 LSB
+  bool chromaTable; // the chroma mapping is interpolated from a 3D table where the result stays within 1 LSB
+  uint16_t blInputBitDepth; // the samples are passed in at this depth, the output is always in the container depth
+  uint16_t elInputBitDepth;
+
+  DoViFrameParams decoded;
+  const DoViFrameParams* currentParams;
+  DoViFrameInfo currentInfo;
+  DoViFrameParams params; // copy of the current parameters, including the proof modifications
+  DoViParamsCache tablesCache;
+  std::shared_ptr<DoViDerivedTables> tables;
 
-  uint8_t bl_bit_depth;
-  uint8_t el_bit_depth;
-  uint8_t out_bit_depth;
-  uint8_t coeff_log2_denom;
-  bool is_fel;
   bool disable_residual_flag;
   bool scene_refresh_flag;
+  bool identity_mapping;
+  bool standard_matrix;
 
   uint16_t max_pq;
   uint16_t max_content_light_level;
+  uint16_t active_area_left_offset;
+  uint16_t active_area_right_offset;
+  uint16_t active_area_top_offset;
+  uint16_t active_area_bottom_offset;
   int16_t ycc_to_rgb_coef[9];
   uint32_t ycc_to_rgb_offset[3];
 
   static const uint16_t ycc_to_rgb_coef_scale_shifts = 13;
   static const uint16_t ycc_to_rgb_offset_scale_shifts = (28-containerBitDepth);
   static const uint16_t rgb_to_lms_coef_scale_shifts = 14;
-
-  uint8_t num_pivots_minus1[3];
-  std::vector<std::vector<uint16_t>> pivot_value;
-
-  std::vector<std::vector<uint8_t>> mapping_idc;
-  std::vector<std::vector<uint8_t>> poly_order;
-  std::vector<std::vector<std::vector<int32_t>>> fp_poly_coef;
-
-  std::vector<std::vector<uint8_t>> mmr_order;
-  std::vector<std::vector<int32_t>> fp_mmr_const;
-  std::vector<std::vector<std::vector<std::vector<int32_t>>>> fp_mmr_coef;
-
-  uint16_t nlq_offset[3];
-  uint32_t fp_hdr_in_max[3];
-  uint32_t fp_linear_deadzone_slope[3];
-  uint32_t fp_linear_deadzone_threshold[3];
 };
 
 uint16_t DoViProcessor::pq2nits(uint16_t pq)
@@ -149,35 +202,6 @@ constexpr uint16_t DoViProcessor::Clip3(uint16_t lower, uint16_t upper, int valu
   return max(min(value, upper), lower);
 }
 
-/*
-*  these upsampling functions are not following the paper, but should be correct when assuming top-left chroma location
-*/
-constexpr uint16_t DoViProcessor::upsampleChromaEven(const uint16_t* y, int n)
-{
-  return y[n];
-}
-
-constexpr uint16_t DoViProcessor::upsampleChromaOdd(const uint16_t* y, int n)
-{
-  // this is spline16 at positions 0.5, 1.5
-  auto val = (-307 * y[n - 1] + 2355 * y[n] + 2355 * y[n + 1] - 307 * y[n + 2] + 2048) >> 12;
-  return Clip3(0, 0xFFFF, val);
-}
-
-constexpr uint16_t DoViProcessor::upsampleLumaEven(const uint16_t* y, int n)
-{
-  // this matches quite exactly spline16 at positions -1.75, -0.75, 0.25, 1.25
-  auto val = (-3 * y[n - 2] + 29 * y[n - 1] + 111 * y[n] - 9 * y[n + 1] + 64) >> 7;
-  return Clip3(0, 0xFFFF, val);
-}
-
-constexpr uint16_t DoViProcessor::upsampleLumaOdd(const uint16_t* y, int n)
-{
-  // this matches quite exactly spline16 at positions -1.25, -0.25, 0.75, 1.75
-  auto val = (-9 * y[n - 1] + 111 * y[n] + 29 * y[n + 1] - 3 * y[n + 2] + 64) >> 7;
-  return Clip3(0, 0xFFFF, val);
-}
-
 /*
 * these are the original upsampling functions from the paper and seem to assume center-left chroma location which is actually incorrect for hdr sources
 
@@ -247,6 +271,14 @@ uint16_t DoViProcessor::processSampleV(uint16_t bl, uint16_t el, uint16_t mmrBlY
   return processSample(2, bl, el, mmrBlY, mmrBlU, mmrBlV);
 }
 
+uint16_t DoViProcessor::processMappedSampleU(uint16_t mapped, uint16_t el) const {
+  return processMappedSample(1, mapped, el);
+}
+
+uint16_t DoViProcessor::processMappedSampleV(uint16_t mapped, uint16_t el) const {
+  return processMappedSample(2, mapped, el);
+}
+
 void DoViProcessor::sample2rgb(uint16_t& r, uint16_t& g, uint16_t& b, const uint16_t& y, const uint16_t& u, const uint16_t& v) const
 {
   int yf = y - ycc_to_rgb_offset[0];
@@ -257,6 +289,17 @@ void DoViProcessor::sample2rgb(uint16_t& r, uint16_t& g, uint16_t& b, const uint
   b = Clip3(0, 0xFFFF, (ycc_to_rgb_coef[6] * yf + ycc_to_rgb_coef[7] * uf + ycc_to_rgb_coef[8] * vf) >> ycc_to_rgb_coef_scale_shifts);
 }
 
+void DoViProcessor::sample2rgbFloat(float& r, float& g, float& b, const uint16_t& y, const uint16_t& u, const uint16_t& v) const
+{
+  static constexpr float scale = 1.0f / (float(1 << ycc_to_rgb_coef_scale_shifts) * 0xFFFF);
+  int yf = int(y) - int(ycc_to_rgb_offset[0]);
+  int uf = int(u) - int(ycc_to_rgb_offset[1]);
+  int vf = int(v) - int(ycc_to_rgb_offset[2]);
+  r = (ycc_to_rgb_coef[0] * yf + ycc_to_rgb_coef[1] * uf + ycc_to_rgb_coef[2] * vf) * scale;
+  g = (ycc_to_rgb_coef[3] * yf + ycc_to_rgb_coef[4] * uf + ycc_to_rgb_coef[5] * vf) * scale;
+  b = (ycc_to_rgb_coef[6] * yf + ycc_to_rgb_coef[7] * uf + ycc_to_rgb_coef[8] * vf) * scale;
+}
+
 
 // see also:
 // https://code.videolan.org/videolan/libplacebo/-/blob/775a9325a23e26443b562b104c1fe949b99aa3c8/src/colorspace.c
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "DoViFrameParams.h"
+#include <string>
+#include <vector>
+
+/*
+* decodes an unspec62 nal unit holding a profile 7 rpu directly into the flat parameter layout.
+* only the fields needed by DoViBaker are kept: header, mapping, nlq, the matrix and the levels 1, 5 and 6 of the dm data.
+* this follows the syntax as implemented by dovi_tool and ffmpeg, rpus referring to previous rpus are not supported.
+*/
+class DoViRpuDecoder
+{
+public:
+  bool decode(const uint8_t* nalu, size_t len, DoViFrameParams& p, DoViFrameInfo& info);
+  inline const char* getError() const { return error.c_str(); }
+
+private:
+  bool fail(const char* message);
+
+  std::vector<uint8_t> rbsp; // unescaped payload, reused between frames
+  std::string error;
+};
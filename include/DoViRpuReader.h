@@ -0,0 +1,42 @@
+#pragma once
+
+#include "rpu_parser.h"
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+#include <windows.h>
+
+typedef DoviRpuOpaque* (*f_dovi_parse_unspec62_nalu)(const uint8_t* buf, size_t len);
+typedef void (*f_dovi_rpu_free)(DoviRpuOpaque* ptr);
+
+/*
+* memory maps an RPU.bin file and indexes the nal units once, the rpus are only parsed when requested.
+* a small number of parsed rpus is kept, such that peeking at the next frames does not parse them twice.
+* the returned rpus stay valid until more than cacheSize other frames have been requested.
+* the libdovi functions may be null, when only the raw nal units are requested.
+*/
+class DoViRpuReader
+{
+public:
+  DoViRpuReader(const char* path, f_dovi_parse_unspec62_nalu _parse, f_dovi_rpu_free _free, size_t _cacheSize = 16);
+  virtual ~DoViRpuReader();
+
+  inline bool isValid() const { return error.empty(); }
+  inline const char* getError() const { return error.c_str(); }
+  inline int getLength() const { return int(index.size()); }
+  DoviRpuOpaque* getRpu(int frame);
+  inline const uint8_t* getNalu(int frame, size_t& len) const { len = index[frame].second; return view + index[frame].first; }
+
+private:
+  f_dovi_parse_unspec62_nalu dovi_parse_unspec62_nalu;
+  f_dovi_rpu_free dovi_rpu_free;
+  const size_t cacheSize;
+
+  HANDLE file;
+  HANDLE mapping;
+  const uint8_t* view;
+  std::vector<std::pair<uint64_t, uint32_t>> index; // offset and length of the nal unit of each frame
+  std::list<std::pair<int, DoviRpuOpaque*>> cache; // most recently used first
+  std::string error;
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "DoViFrameParams.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <windows.h>
+
+/*
+* binary sidecar written by DoViAnalyzer, holding the decoded parameters of all frames of an rpu file.
+* identical parameter blocks are stored only once, every frame refers to its block by index.
+* DoViBaker maps the file into memory and thus does not need libdovi at all.
+*/
+struct DoViSidecarHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t params_size;
+  uint32_t info_size;
+  uint32_t num_frames;
+  uint32_t num_params;
+  uint32_t reserved;
+  uint64_t info_offset;
+  uint64_t params_offset;
+};
+
+class DoViSidecar
+{
+public:
+  static const char magic[8];
+  static const uint32_t version = 2;
+
+  DoViSidecar(const char* path);
+  virtual ~DoViSidecar();
+  static bool isSidecar(const char* path);
+
+  inline bool isValid() const { return error.empty(); }
+  inline const char* getError() const { return error.c_str(); }
+  inline int getClipLength() const { return header->num_frames; }
+  inline const DoViFrameInfo& getFrameInfo(int frame) const { return info[frame]; }
+  inline const DoViFrameParams& getFrameParams(const DoViFrameInfo& frameInfo) const { return params[frameInfo.params_index]; }
+
+private:
+  HANDLE file;
+  HANDLE mapping;
+  const void* view;
+  const DoViSidecarHeader* header;
+  const DoViFrameInfo* info;
+  const DoViFrameParams* params;
+  std::string error;
+};
+
+class DoViSidecarWriter
+{
+public:
+  void addFrame(const DoViFrameParams& frameParams, DoViFrameInfo frameInfo);
+  bool write(const char* path) const;
+
+private:
+  std::vector<DoViFrameInfo> info;
+  std::vector<DoViFrameParams> params;
+  std::unordered_multimap<uint64_t, uint32_t> paramsIndex;
+};
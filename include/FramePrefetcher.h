@@ -0,0 +1,51 @@
+#pragma once
+#pragma warning(push)
+#pragma warning(disable: 4512 4244 4100 693)
+#include "avisynth.h"
+#pragma warning(pop)
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+
+/*
+* requests the frames following the current one from the given clip ahead of time as jobs on the avisynth thread pool,
+* such that decoding of the upstream filters overlaps with the processing of the current frame.
+* each job requests its frame with the script environment of the pool thread executing it.
+* the filter registers no mt mode and runs as multi instance, so each prefetcher has a single caller and a single cursor.
+* this only pays off for linear access, on random access the prefetched frames are dropped.
+* the optional isNeeded callback is asked on the calling thread whether a frame will be used at all.
+* without the avisynth+ thread pool interface the frames are requested synchronously.
+*/
+class FramePrefetcher
+{
+public:
+  FramePrefetcher(PClip _clip, int _depth, std::function<bool(int)> _isNeeded = nullptr);
+  virtual ~FramePrefetcher();
+
+  PVideoFrame GetFrame(int n, IScriptEnvironment* env);
+
+private:
+  struct Job
+  {
+    FramePrefetcher* self;
+    int k;
+  };
+  static AVSValue runJob(IScriptEnvironment2* env, void* data);
+  inline bool inWindow(int k) const { return !stop && k >= current && k <= current + depth; }
+
+  PClip clip;
+  const int depth;
+  const int numFrames;
+  const std::function<bool(int)> isNeeded;
+
+  std::mutex mtx;
+  std::condition_variable workDone;
+
+  int current;
+  bool stop;
+  std::set<int> inFlight;
+  std::map<int, PVideoFrame> ready;
+};
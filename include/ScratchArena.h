@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+* per thread scratch memory for the row buffers used while processing a frame.
+* the memory is kept across frames, so the hot path does not allocate once the arena has grown to its peak size.
+* allocations are released in reverse order by the Scope which made them, which also allows nested use.
+*/
+class ScratchArena
+{
+public:
+  static const size_t alignment = 64;
+
+  class Scope
+  {
+  public:
+    Scope() : arena(ScratchArena::local()), mark(arena.used) {}
+    ~Scope() { arena.release(mark); }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    // uninitialized memory for count elements, aligned to 64 bytes
+    template<typename T>
+    T* alloc(size_t count) { return static_cast<T*>(arena.allocate(count * sizeof(T))); }
+
+  private:
+    ScratchArena& arena;
+    const size_t mark;
+  };
+
+  ScratchArena();
+  ~ScratchArena();
+
+private:
+  static ScratchArena& local();
+  void* allocate(size_t bytes);
+  void release(size_t mark);
+
+  struct Overflow
+  {
+    size_t mark;
+    void* ptr;
+  };
+
+  uint8_t* block;
+  size_t capacity;
+  size_t used;
+  size_t peak;
+  // allocations which did not fit into the block anymore, the block grows to the peak size once it is empty again
+  std::vector<Overflow> overflow;
+};